@@ -6,6 +6,8 @@ mkdir build || true
 cd build
 cmake ..
 make -j
+# Run the tests, the Windows build has none
+ctest --output-on-failure
 
 # Choose the appropriate library based on the architecture
 if [[ "$(uname -m)" == "x86_64" ]]; then
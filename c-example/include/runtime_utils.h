@@ -28,15 +28,149 @@ typedef struct Runtime {
   const char *(*runtime_version)();
   const char *(*runtime_name)();
 
+  // Allocator of the runtime, which frees the inputs it is sent and allocates
+  // the outputs it returns. An isolated instance has a C library, hence a
+  // heap, of its own.
+  void *(*allocate)(size_t size);
+  void (*deallocate)(void *pointer);
+
   // Internal fields
   char *_library_path;
   void *_handle;
 } Runtime;
 
+// Interpolation used to resize the input image
+typedef enum ResizeInterpolation {
+  RESIZE_NEAREST,   // Nearest neighbor
+  RESIZE_BILINEAR,  // Bilinear, with aligned pixel centers
+  RESIZE_AREA,      // Box filter averaging, for downscaling
+} ResizeInterpolation;
+
+// Several instances of the same runtime, sharing the work.
+// The OAAX interface is process-global, so each instance beyond the first is a
+// copy of the library loaded in its own dlmopen namespace (glibc only, with at
+// most 16 namespaces per process).
+typedef struct RuntimeGroup {
+  Runtime **runtimes;   // Runtime instances
+  long *in_flight;      // Requests in flight per instance, updated atomically
+  size_t num_runtimes;  // Number of runtime instances
+  size_t next_to_poll;  // Only used by the receiving thread
+} RuntimeGroup;
+
+// Adaptive wait between two polls of `receive_output`: spin first, then yield
+// the core, then sleep with an exponential backoff up to a cap
+typedef struct OutputPoller {
+  RuntimeGroup *runtimes;
+  int spin_polls;             // Polls retried after a CPU pause hint
+  int yield_polls;            // Polls retried after yielding the core
+  unsigned int min_sleep_us;  // First backoff sleep
+  unsigned int max_sleep_us;  // Backoff sleep cap
+} OutputPoller;
+
+// Maximum number of logical CPUs of one physical core, i.e. its hyper-threads
+#define MAX_CPUS_PER_CORE 8
+
+// Logical CPUs sharing one physical core
+typedef struct PhysicalCore {
+  int package;  // Physical package ID, -1 if unknown
+  int id;       // Core ID in its package
+  int cpus[MAX_CPUS_PER_CORE];
+  size_t num_cpus;
+} PhysicalCore;
+
+// Placement of the threads on the physical cores (Linux only): the receive and
+// send threads get a core each, and the runtime instances split the remaining
+// cores evenly, so that they neither migrate nor compete for a core
+typedef struct AffinityPlan {
+  PhysicalCore *cores;  // Cores the process may run on, by package and core
+  size_t num_cores;
+  int receive_core;  // Index in `cores`, -1 when unpinned
+  int send_core;     // Index in `cores`, -1 when unpinned
+  // Instance i runs on the cores [i, i + 1) * cores_per_runtime
+  size_t cores_per_runtime;
+  // Runtime arguments that fit the cores of an instance
+  int n_duplicates;
+  int n_threads_per_duplicate;
+} AffinityPlan;
+
+// Called with every output received by `run_output_poller`, together with the
+// runtime instance it came from. The callback takes ownership of the output
+// tensors.
+typedef void (*OutputCallback)(tensors_struct *output_tensors, size_t instance,
+                               void *user_data);
+
 // Function prototypes
 Runtime *initialize_runtime(const char *library_path);
 void destroy_runtime(Runtime *runtime_env);
 
+/**
+ * @brief Load `num_instances` isolated instances of the runtime library. A
+ * single instance is loaded like `initialize_runtime`.
+ * @param [in] library_path Path to the runtime library
+ * @param [in] num_instances Number of instances to load
+ *
+ * @return Pointer to the runtime group, or NULL on failure
+ */
+RuntimeGroup *initialize_runtime_group(const char *library_path,
+                                       size_t num_instances);
+
+/**
+ * @brief Destroy every runtime instance of the group and free the group
+ * @param [in] group Runtime group
+ */
+void destroy_runtime_group(RuntimeGroup *group);
+
+/**
+ * @brief Pick the runtime instance with the fewest requests in flight
+ * @param [in] group Runtime group
+ *
+ * @return Index of the instance
+ */
+size_t least_loaded_runtime(RuntimeGroup *group);
+
+/**
+ * @brief Send the input tensors to one runtime instance, see `send_input`
+ * @param [in] group Runtime group
+ * @param [in] instance Index of the instance
+ * @param [in] input_tensors Input tensors, owned by the runtime on success
+ *
+ * @return 0 on success
+ */
+int runtime_group_send_input(RuntimeGroup *group, size_t instance,
+                             tensors_struct *input_tensors);
+
+/**
+ * @brief Receive an output from any runtime instance, polling them in turn.
+ * Must be called from a single thread.
+ * @param [in] group Runtime group
+ * @param [out] output_tensors Received output tensors
+ * @param [out] instance Index of the instance the output came from
+ *
+ * @return 0 if an output was received
+ */
+int runtime_group_receive_output(RuntimeGroup *group,
+                                 tensors_struct **output_tensors,
+                                 size_t *instance);
+
+/**
+ * @brief Deep copy tensors with the allocator of a runtime instance, e.g. an
+ * input to send to it
+ * @param [in] runtime Runtime instance
+ * @param [in] tensors Tensors to copy, of known data types
+ *
+ * @return Copy of the tensors, or NULL on failure
+ */
+tensors_struct *copy_tensors_for_runtime(const Runtime *runtime,
+                                         const tensors_struct *tensors);
+
+/**
+ * @brief Free tensors allocated with the allocator of a runtime instance, e.g.
+ * an output it returned
+ * @param [in] runtime Runtime instance
+ * @param [in] tensors Tensors to free
+ */
+void free_runtime_tensors(const Runtime *runtime, tensors_struct *tensors);
+
 /**
  * @brief Resize the image using nearest neighbor interpolation
  * @param [in] image Input image
@@ -51,7 +185,9 @@ void resize_image(const unsigned char *image, int width, int height,
 
 /**
  * @brief Load the image from the file path, resize it, normalize it and convert
- * it to float.
+ * it to float. The JPEG is decoded directly at the largest 1/2, 1/4 or 1/8
+ * reduction that still covers the desired size, then streamed scanline by
+ * scanline into the output tensor without materializing the full image.
  * @param [in] image_path Path to the image file
  * @param [in] new_width Desired width of the image
  * @param [in] new_height Desired height of the image
@@ -60,10 +196,12 @@ void resize_image(const unsigned char *image, int width, int height,
  * subtraction)
  * @param [in] nchw Boolean flag to indicate if the image should be in NCHW or
  * NHWC format
+ * @param [in] interpolation Interpolation used to resize the image
  * @return Pointer to the resized image in float format
  */
 void *load_image(const char *image_path, int new_width, int new_height,
-                 float mean, float std, bool nchw);
+                 float mean, float std, bool nchw,
+                 ResizeInterpolation interpolation);
 
 /**
  * @brief Build the tensors struct from the input data
@@ -77,4 +215,84 @@ void *load_image(const char *image_path, int new_width, int new_height,
 tensors_struct *build_tensors_struct(uint8_t *data, size_t height, size_t width,
                                      size_t channels);
 
+/**
+ * @brief Print the data of every tensor, read according to its data type and
+ * counted over all of its dimensions. Tensors of other data types than float,
+ * uint8 and int8 are skipped.
+ * @param [in] tensors Tensors struct to print
+ * @param [in] max_elements Maximum number of elements printed per tensor
+ */
+void print_tensors_data(const tensors_struct *tensors, size_t max_elements);
+
+/**
+ * @brief Current time of a monotonic clock, in microseconds
+ */
+uint64_t monotonic_time_us(void);
+
+/**
+ * @brief Initialize the output poller with the default backoff parameters
+ * @param [out] poller Output poller
+ * @param [in] runtimes Runtime instances to receive the outputs from
+ */
+void init_output_poller(OutputPoller *poller, RuntimeGroup *runtimes);
+
+/**
+ * @brief Wait for the next output of the runtime
+ * @param [in] poller Output poller
+ * @param [out] output_tensors Received output tensors
+ * @param [out] instance Index of the runtime instance the output came from
+ * @param [in] timeout_ms Maximum time to wait for an output
+ *
+ * @return 0 if an output was received, 1 on timeout
+ */
+int poll_output(OutputPoller *poller, tensors_struct **output_tensors,
+                size_t *instance, unsigned int timeout_ms);
+
+/**
+ * @brief Deliver up to `count` outputs of the runtime to the callback,
+ * stopping early when no output arrives within the timeout
+ * @param [in] poller Output poller
+ * @param [in] count Number of outputs to receive
+ * @param [in] callback Function called with every output
+ * @param [in] user_data Pointer passed to the callback
+ * @param [in] timeout_ms Maximum time to wait for each output
+ *
+ * @return Number of outputs delivered
+ */
+int run_output_poller(OutputPoller *poller, int count, OutputCallback callback,
+                      void *user_data, unsigned int timeout_ms);
+
+/**
+ * @brief Read the physical cores the process may run on from
+ * /sys/devices/system/cpu, and plan which of them every thread runs on. When
+ * the threads can not be pinned, they are left unpinned and the runtime gets a
+ * single duplicate with a single thread.
+ * @param [out] plan Affinity plan, to destroy with `destroy_affinity_plan`
+ * @param [in] num_instances Number of runtime instances
+ * @param [in] threads_per_duplicate Threads of every model duplicate, 0 for a
+ * single duplicate using all the cores of its instance
+ *
+ * @return 0 if the threads can be pinned
+ */
+int plan_affinity(AffinityPlan *plan, size_t num_instances,
+                  int threads_per_duplicate);
+
+/**
+ * @brief Free the cores of the plan
+ * @param [in] plan Affinity plan
+ */
+void destroy_affinity_plan(AffinityPlan *plan);
+
+/**
+ * @brief Restrict the calling thread to the logical CPUs of `count` cores of
+ * the plan. Threads it creates afterwards inherit them.
+ * @param [in] plan Affinity plan
+ * @param [in] first_core Index of the first core in the plan
+ * @param [in] count Number of cores
+ *
+ * @return 0 on success
+ */
+int pin_thread_to_cores(const AffinityPlan *plan, size_t first_core,
+                        size_t count);
+
 #endif  // C_EXAMPLE_INCLUDE_RUNTIME_UTILS_H_
@@ -12,6 +12,10 @@
 
 #include "runtime_utils.h"  // NOLINT[build/include]
 
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
 // C utilities
 #include "logger.h"     // NOLINT[build/include]
 #include "memory.h"     // NOLINT[build/include]
@@ -22,99 +26,219 @@
 // Number of inferences to perform
 // NOTE: Adjust this as you see fit
 #define NUMBER_OF_INFERENCES 10
-
-// Logger
+// Maximum number of isolated runtime instances, see `initialize_runtime_group`
+#define MAX_RUNTIME_INSTANCES 16
+// Pin the threads and the runtime instances to physical cores of their own
+// (Linux only), see `plan_affinity`
+// NOTE: Adjust these as you see fit
+#define PIN_THREADS 0
+// Threads of every model duplicate, 0 for a single duplicate per instance.
+// Several duplicates may complete requests out of order, see `handle_output`
+#define THREADS_PER_DUPLICATE 0
+// Elements printed per output tensor of the last inference
+#define MAX_PRINTED_ELEMENTS 60
+
+// Counters shared by the sending and the receiving threads. A store publishes
+// every write made before it to the thread that loads it.
+#ifdef _WIN32
+#define SHARED_STORE(counter, value) \
+  InterlockedExchange((volatile LONG *)(counter), (value))
+#define SHARED_LOAD(counter) \
+  InterlockedCompareExchange((volatile LONG *)(counter), 0, 0)
+#else
+#define SHARED_STORE(counter, value) \
+  __atomic_store_n((counter), (value), __ATOMIC_RELEASE)
+#define SHARED_LOAD(counter) __atomic_load_n((counter), __ATOMIC_ACQUIRE)
+#endif
+
+// Logger, shared by every pipeline of the process and by the runtime utils
 Logger *logger = NULL;
 
-// Global variable to hold the original input tensors
-tensors_struct *original_input_tensors = NULL;
+// State of one inference pipeline: the runtimes it sends to, its input and its
+// statistics. Pipelines share nothing else, so several of them can run in one
+// process, e.g. with different models or runtimes.
+typedef struct {
+  RuntimeGroup *runtimes;
+  // Cores of the send and receive threads
+  const AffinityPlan *affinity;
+  // Original input tensors, deep copied for every request with the allocator
+  // of the instance it is sent to
+  tensors_struct *original_input_tensors;
+  // Send time and end-to-end latency of every request, indexed by request ID.
+  // A send time is written before its input is handed to the runtime, and
+  // only read once its output came back.
+  uint64_t send_times_us[NUMBER_OF_INFERENCES];
+  uint64_t latencies_us[NUMBER_OF_INFERENCES];
+  // Request IDs sent to each runtime instance, in send order. An instance with
+  // one model duplicate completes its requests in order, so its n-th output
+  // belongs to request instance_requests[instance][n]. With several
+  // duplicates, the latencies are approximate.
+  int instance_requests[MAX_RUNTIME_INSTANCES][NUMBER_OF_INFERENCES];
+  int sent_to_instance[MAX_RUNTIME_INSTANCES];        // Send thread only
+  int received_from_instance[MAX_RUNTIME_INSTANCES];  // Receive thread only
+  int received_outputs;                               // Receive thread only
+  // Requests handed to the runtimes, and whether the send thread is done, so
+  // that the receive thread waits for those requests only. Shared counters.
+  long sent_requests;
+  long sending_done;
+} InferenceContext;
 
 // Thread function for sending inputs
 void *send_input_thread(void *arg) {
-  Runtime *runtime = (Runtime *)arg;
+  InferenceContext *context = (InferenceContext *)arg;
+  RuntimeGroup *runtimes = context->runtimes;
   int code = 0;
+  if (context->affinity->send_core >= 0) {
+    pin_thread_to_cores(context->affinity, context->affinity->send_core, 1);
+  }
 
   for (int i = 0; i < NUMBER_OF_INFERENCES; i++) {
-    // Deep copy the input tensors
+    // Send the input tensors, stamped with their request ID `i`, to the
+    // runtime instance with the fewest requests in flight
+    size_t instance = least_loaded_runtime(runtimes);
+    Runtime *runtime = runtimes->runtimes[instance];
+
+    // Deep copy the input tensors into the heap of that instance, which frees
+    // them
     tensors_struct *input_tensors =
-        deep_copy_tensors_struct(original_input_tensors);
+        copy_tensors_for_runtime(runtime, context->original_input_tensors);
     if (input_tensors == NULL) {
       log_error(logger, "Failed to deep copy input tensors.");
       continue;
     }
 
-    // Send the input tensors
-    code = runtime->send_input(input_tensors);
+    context->instance_requests[instance][context->sent_to_instance[instance]] =
+        i;
+    context->send_times_us[i] = monotonic_time_us();
+    code = runtime_group_send_input(runtimes, instance, input_tensors);
     if (code != 0) {
       log_error(logger, "Failed to send input tensors.");
-      deep_free_tensors_struct(input_tensors);  // Free before returning
-      return NULL;
+      free_runtime_tensors(runtime, input_tensors);  // Free before stopping
+      break;
     }
 
     // Ownership of input_tensors is transferred to the runtime
     // The inference thread will free input_tensors after processing
 
-    log_debug(logger, "-> Sent input %d", i + 1);
+    context->sent_to_instance[instance]++;
+    SHARED_STORE(&context->sent_requests, context->sent_requests + 1);
+    log_debug(logger, "-> Sent input %d to runtime %zu", i + 1, instance);
   }
 
+  // No more requests: the receive thread stops at the ones sent
+  SHARED_STORE(&context->sending_done, 1);
   return NULL;
 }
 
+// Handle one output received from a runtime instance
+void handle_output(tensors_struct *output_tensors, size_t instance,
+                   void *user_data) {
+  InferenceContext *context = (InferenceContext *)user_data;
+  Runtime *runtime = context->runtimes->runtimes[instance];
+  int received = context->received_from_instance[instance];
+  if (received >= NUMBER_OF_INFERENCES) {
+    log_warning(logger, "Received output tensors without a request from %zu.",
+                instance);
+    free_runtime_tensors(runtime, output_tensors);
+    return;
+  }
+  context->received_from_instance[instance]++;
+  int request = context->instance_requests[instance][received];
+  context->latencies_us[request] =
+      monotonic_time_us() - context->send_times_us[request];
+  // if last iteration print out the output
+  if (context->received_outputs == NUMBER_OF_INFERENCES - 1) {
+    print_tensors_metadata(output_tensors);
+    // Print tensors data, whatever their data type and rank
+    log_info(logger, "Output tensors data:");
+    print_tensors_data(output_tensors, MAX_PRINTED_ELEMENTS);
+  }
+
+  // Free the output tensors, allocated in the heap of their instance
+  free_runtime_tensors(runtime, output_tensors);
+  context->received_outputs++;
+  log_debug(logger, "<- Received output %d (request %d), latency %llu us",
+            context->received_outputs, request + 1,
+            (unsigned long long)context->latencies_us[request]);
+}
+
+static int compare_uint64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Log the mean and percentiles of the latencies of the received requests
+void report_latencies(const InferenceContext *context) {
+  uint64_t sorted[NUMBER_OF_INFERENCES];
+  uint64_t sum = 0;
+  int count = 0;
+  for (size_t instance = 0; instance < MAX_RUNTIME_INSTANCES; instance++) {
+    for (int n = 0; n < context->received_from_instance[instance]; n++) {
+      sorted[count] =
+          context->latencies_us[context->instance_requests[instance][n]];
+      sum += sorted[count++];
+    }
+  }
+  if (count == 0) return;
+  qsort(sorted, count, sizeof(uint64_t), compare_uint64);
+  log_info(logger,
+           "Latency over %d requests: mean %llu us, p50 %llu us, p99 %llu us, "
+           "max %llu us",
+           count, (unsigned long long)(sum / count),
+           (unsigned long long)sorted[count / 2],
+           (unsigned long long)sorted[count * 99 / 100],
+           (unsigned long long)sorted[count - 1]);
+}
+
 // Thread function for receiving outputs
 void *receive_output_thread(void *arg) {
-  Runtime *runtime = (Runtime *)arg;
-  tensors_struct *output_tensors = NULL;
-  int received_outputs = 0;
-  int attempts = 0;
-  // Maximum number of consecutive failed attempts to receive output tensors
-  // before giving up This is useful in case the runtime is not able to provide
-  // output tensors for some reason
+  InferenceContext *context = (InferenceContext *)arg;
+  // Maximum time to wait for the next output before giving up
+  // This is useful in case the runtime is not able to provide output tensors
+  // for some reason
   // NOTE: Adjust this as you see fit
-  const int MAX_ATTEMPTS = 10;
+  const unsigned int MAX_WAIT_MS = 1000;
+  if (context->affinity->receive_core >= 0) {
+    pin_thread_to_cores(context->affinity, context->affinity->receive_core, 1);
+  }
 
-  while (received_outputs < NUMBER_OF_INFERENCES) {
-    // Receive the output tensors
-    int code = runtime->receive_output(&output_tensors);
-    if (code != 0) {
-      log_warning(logger, "No more output tensors available. Attempt %d",
-                  attempts + 1);
-      attempts++;
-      if (attempts >= MAX_ATTEMPTS) {
+  // Wait in slices of WAIT_SLICE_MS, to notice in time that the send thread is
+  // done and every request it sent came back
+  const unsigned int WAIT_SLICE_MS = 10;
+
+  // Poll the runtimes with an adaptive wait, instead of fixed retry sleeps, so
+  // that an output is picked up as soon as it is ready
+  OutputPoller poller;
+  init_output_poller(&poller, context->runtimes);
+  unsigned int waited_ms = 0;
+  while (true) {
+    // Once the send thread is done, the number of requests sent is final
+    bool sending_done = SHARED_LOAD(&context->sending_done) != 0;
+    int sent_requests = (int)SHARED_LOAD(&context->sent_requests);
+    if (sending_done && context->received_outputs >= sent_requests) {
+      break;
+    }
+    tensors_struct *output_tensors = NULL;
+    size_t instance = 0;
+    if (poll_output(&poller, &output_tensors, &instance, WAIT_SLICE_MS) != 0) {
+      waited_ms += WAIT_SLICE_MS;
+      if (waited_ms >= MAX_WAIT_MS) {
         log_error(logger,
-                  "Exceeded maximum attempts to receive output tensors.");
+                  "Timed out waiting for output tensors after %d of %d "
+                  "outputs.",
+                  context->received_outputs, sent_requests);
         break;
       }
-      sleep_ms(100);  // Wait before retrying
       continue;
     }
-    attempts = 0;  // Reset attempts after a successful receive
-
-    // if last iteration print out the output
-    if (received_outputs == NUMBER_OF_INFERENCES - 1) {
-      print_tensors_metadata(output_tensors);
-      // Print tensors data
-      log_info(logger, "Output tensors data:");
-      for (int64_t i = 0; i < output_tensors->num_tensors; i++) {
-        log_info(logger, "Tensor %zu:", i);
-        int64_t size =
-            output_tensors->shapes[i][0] * output_tensors->shapes[i][1];
-        log_info(logger, "Tensor %zu size: %lld", i, size);
-        for (int64_t j = 0; j < size; j++) {
-          // Print the first 10 elements of the tensor data
-          printf("%f ", ((float *)output_tensors->data[i])[j]);
-          if (j % 6 == 5) {  // Print a new line every 6 elements
-            printf("\n");
-          }
-        }
-      }
-    }
-
-    // Free the output tensors
-    deep_free_tensors_struct(output_tensors);
-    output_tensors = NULL;
-    received_outputs++;
-    log_debug(logger, "<- Received output %d", received_outputs);
+    waited_ms = 0;
+    handle_output(output_tensors, instance, context);
+  }
+  if (context->received_outputs < NUMBER_OF_INFERENCES) {
+    log_warning(logger, "Received %d of %d outputs.",
+                context->received_outputs, NUMBER_OF_INFERENCES);
   }
+  report_latencies(context);
 
   return NULL;
 }
@@ -122,6 +246,7 @@ void *receive_output_thread(void *arg) {
 int main(int argc, char **argv) {
   // Utils
   Timer timer;
+  InferenceContext context = {0};
   // Create a logger that prints and saves logs to a file
   // NOTE: adjust the logger params: file name, file log level, and console log
   // level See OAAX/examples/tools/c-utilities/include/logger.h for more details
@@ -131,8 +256,10 @@ int main(int argc, char **argv) {
     return 1;
   }
   // Check command-line arguments
-  if (argc != 4) {
-    log_error(logger, "Usage: %s <library_path> <model_path> <image_path>",
+  if (argc != 4 && argc != 5) {
+    log_error(logger,
+              "Usage: %s <library_path> <model_path> <image_path> "
+              "[number_of_runtime_instances]",
               argv[0]);
     return 1;
   }
@@ -140,88 +267,136 @@ int main(int argc, char **argv) {
   char *library_path = argv[1];
   char *model_path = argv[2];
   char *image_path = argv[3];
+  // Isolated instances of the runtime to spread the inferences over
+  int n_instances = argc == 5 ? atoi(argv[4]) : 1;
+  if (n_instances < 1 || n_instances > MAX_RUNTIME_INSTANCES) {
+    log_error(logger, "The number of runtime instances must be in [1, %d].",
+              MAX_RUNTIME_INSTANCES);
+    return 1;
+  }
   log_info(logger, "Library path: %s", library_path);
   log_info(logger, "Model path: %s", model_path);
   log_info(logger, "Image path: %s", image_path);
+  log_info(logger, "Runtime instances: %d", n_instances);
 
-  // Initialize the runtime environment
-  Runtime *runtime = initialize_runtime(library_path);
-  if (runtime == NULL) {
+  // Initialize the runtime environment, once per instance
+  RuntimeGroup *runtimes = initialize_runtime_group(library_path, n_instances);
+  if (runtimes == NULL) {
     log_error(logger, "Failed to initialize runtime.");
     return 1;
   }
 
+  context.runtimes = runtimes;
+
+  // Plan which cores the threads and the runtime instances run on
+  AffinityPlan affinity = {.receive_core = -1,
+                           .send_core = -1,
+                           .n_duplicates = 1,
+                           .n_threads_per_duplicate = 1};
+  if (PIN_THREADS) {
+    plan_affinity(&affinity, runtimes->num_runtimes, THREADS_PER_DUPLICATE);
+  }
+  context.affinity = &affinity;
+  // Outputs are matched to the requests of their instance in send order
+  if (affinity.n_duplicates > 1) {
+    log_warning(logger,
+                "%d model duplicates per runtime instance may complete "
+                "requests out of order: the latencies are approximate.",
+                affinity.n_duplicates);
+  }
+
   log_info(logger, "Runtime name: %s - Runtime version: %s",
-           runtime->runtime_name(), runtime->runtime_version());
-
-  // Initialize the runtime with arguments
-  // These parameters are runtime-specific and may vary based on the runtime you
-  // are using They are compatible for the CPU runtime and they server as
-  // n_duplicates: Number of model duplicates that run asynchronously
-  // n_threads_per_duplicate: Number of threads per model duplicate
-  // NOTE: Adjust these parameters as you see fit
-  int n_duplicates = 1;
-  int n_threads_per_duplicate = 1;
-  int runtime_log_level = 3;
-  int return_code = runtime->runtime_initialization_with_args(
-      3,
-      (const char *[]){"n_duplicates", "n_threads_per_duplicate",
-                       "runtime_log_level"},
-      (const void *[]){&n_duplicates, &n_threads_per_duplicate,
-                       &runtime_log_level});
-
-  if (return_code != 0) {
-    log_error(logger, "Failed to initialize runtime environment.");
-    destroy_runtime(runtime);  // Clean up resources
-    return 1;
+           runtimes->runtimes[0]->runtime_name(),
+           runtimes->runtimes[0]->runtime_version());
+
+  for (size_t i = 0; i < runtimes->num_runtimes; i++) {
+    Runtime *runtime = runtimes->runtimes[i];
+    // The threads the runtime starts inherit the cores of this thread
+    if (affinity.cores_per_runtime > 0) {
+      pin_thread_to_cores(&affinity, i * affinity.cores_per_runtime,
+                          affinity.cores_per_runtime);
+    }
+    // Initialize the runtime with arguments
+    // These parameters are runtime-specific and may vary based on the runtime
+    // you are using They are compatible for the CPU runtime and they server as
+    // n_duplicates: Number of model duplicates that run asynchronously
+    // n_threads_per_duplicate: Number of threads per model duplicate
+    // Both are derived from the cores of the instance, see `plan_affinity`
+    int n_duplicates = affinity.n_duplicates;
+    int n_threads_per_duplicate = affinity.n_threads_per_duplicate;
+    int runtime_log_level = 3;
+    int return_code = runtime->runtime_initialization_with_args(
+        3,
+        (const char *[]){"n_duplicates", "n_threads_per_duplicate",
+                         "runtime_log_level"},
+        (const void *[]){&n_duplicates, &n_threads_per_duplicate,
+                         &runtime_log_level});
+
+    if (return_code != 0) {
+      log_error(logger, "Failed to initialize runtime environment %zu.", i);
+      destroy_affinity_plan(&affinity);
+      destroy_runtime_group(runtimes);  // Clean up resources
+      return 1;
+    }
+
+    // Load the model
+    if (runtime->runtime_model_loading(model_path) != 0) {
+      log_error(logger, "Failed to load model into runtime %zu.", i);
+      destroy_affinity_plan(&affinity);
+      destroy_runtime_group(runtimes);  // Clean up resources
+      return 1;
+    }
   }
 
-  // Load the model
-  if (runtime->runtime_model_loading(model_path) != 0) {
-    log_error(logger, "Failed to load model.");
-    destroy_runtime(runtime);  // Clean up resources
-    return 1;
+  // Back to every core, for the threads started from now on
+  if (affinity.num_cores > 0) {
+    pin_thread_to_cores(&affinity, 0, affinity.num_cores);
   }
 
   // Load the image
   // NOTE: Depending on the model inputs, you may need to change the image size,
-  // mean, std and the tensors struct Also, make sure to adapt the
-  // `resize_image` and `build_tensors_struct` function to your needs
-  uint8_t *data = (uint8_t *)load_image(image_path, 320, 240, 127, 128, true);
+  // mean, std, interpolation and the tensors struct Also, make sure to adapt
+  // the `build_tensors_struct` function to your needs
+  uint8_t *data = (uint8_t *)load_image(image_path, 320, 240, 127, 128, true,
+                                        RESIZE_BILINEAR);
   if (data == NULL) {
     log_error(logger, "Failed to load image.");
-    destroy_runtime(runtime);  // Clean up resources
+    destroy_affinity_plan(&affinity);
+    destroy_runtime_group(runtimes);  // Clean up resources
     return 1;
   }
   // Create the input tensors struct from the image
   // NOTE: Adjust the image size, mean, std and the tensors struct
   // Also, make sure to adapt the `resize_image` and `build_tensors_struct`
   // function to your needs
-  original_input_tensors = build_tensors_struct(data, 240, 320, 3);
-  if (original_input_tensors == NULL) {
+  context.original_input_tensors = build_tensors_struct(data, 240, 320, 3);
+  if (context.original_input_tensors == NULL) {
     log_error(logger, "Failed to build input tensors.");
-    free(data);                // Free the image data
-    destroy_runtime(runtime);  // Clean up resources
+    free(data);                       // Free the image data
+    destroy_affinity_plan(&affinity);
+    destroy_runtime_group(runtimes);  // Clean up resources
     return 1;
   }
   log_info(logger, "Input tensors created with %zu tensors.",
-           original_input_tensors->num_tensors);
+           context.original_input_tensors->num_tensors);
   // Start sending inputs and receiving outputs
   ThreadHandle send_input_thread_handle, receive_output_thread_handle;
 
-  if (thread_create(&send_input_thread_handle, send_input_thread, runtime) !=
-      0) {
+  if (thread_create(&send_input_thread_handle, send_input_thread,
+                    &context) != 0) {
     log_error(logger, "Failed to create send_input_thread.");
-    deep_free_tensors_struct(original_input_tensors);
-    destroy_runtime(runtime);
+    deep_free_tensors_struct(context.original_input_tensors);
+    destroy_affinity_plan(&affinity);
+    destroy_runtime_group(runtimes);
     return 1;
   }
 
   if (thread_create(&receive_output_thread_handle, receive_output_thread,
-                    runtime) != 0) {
+                    &context) != 0) {
     log_error(logger, "Failed to create receive_output_thread.");
-    deep_free_tensors_struct(original_input_tensors);
-    destroy_runtime(runtime);
+    deep_free_tensors_struct(context.original_input_tensors);
+    destroy_affinity_plan(&affinity);
+    destroy_runtime_group(runtimes);
     return 1;
   }
   log_info(logger, "Threads created successfully. Starting inference...");
@@ -235,14 +410,15 @@ int main(int argc, char **argv) {
 
   // Clean up
   log_info(logger, "Inference completed. Cleaning up resources...");
-  deep_free_tensors_struct(original_input_tensors);
-  original_input_tensors = NULL;
+  deep_free_tensors_struct(context.original_input_tensors);
+  context.original_input_tensors = NULL;
 
-  destroy_runtime(runtime);
+  destroy_affinity_plan(&affinity);
+  destroy_runtime_group(runtimes);
 
   // Optional: Print run stats
   print_memory_usage("CLOSE");
-  print_human_readable_stats(&timer, NUMBER_OF_INFERENCES);
+  print_human_readable_stats(&timer, context.received_outputs);
 
   return 0;
 }
@@ -27,6 +27,9 @@ static const char *get_dl_error() {
 #define DL_ERROR get_dl_error()
 #else
 #include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #define DL_ERROR dlerror()
 #endif
 
@@ -64,7 +67,20 @@ void destroy_runtime(Runtime *runtime) {
   runtime = NULL;
 }
 
-Runtime *initialize_runtime(const char *library_path) {
+// Load a new copy of the library in its own link-map namespace, with its own
+// globals and its own copies of the libraries it depends on
+static void *load_isolated_library(const char *library_path) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+  return dlmopen(LM_ID_NEWLM, library_path, RTLD_NOW | RTLD_LOCAL);
+#else
+  log_error(logger, "Isolated runtime instances require dlmopen (glibc).");
+  return NULL;
+#endif
+}
+
+// Load the runtime library and its interface. With `isolated`, the library is
+// loaded in a new namespace so that several instances can coexist.
+static Runtime *load_runtime(const char *library_path, bool isolated) {
   Runtime *runtime = (Runtime *)calloc(1, sizeof(Runtime));
   if (runtime == NULL) {
     log_error(logger, "Failed to allocate memory for Runtime.");
@@ -88,7 +104,8 @@ Runtime *initialize_runtime(const char *library_path) {
            library_path);
 
   // Load the shared library
-  runtime->_handle = load_dynamic_library(library_path);
+  runtime->_handle = isolated ? load_isolated_library(library_path)
+                              : load_dynamic_library(library_path);
   if (runtime->_handle == NULL) {
     destroy_runtime(runtime);
     log_error(logger, "Failed to load library: %s", DL_ERROR);
@@ -96,6 +113,22 @@ Runtime *initialize_runtime(const char *library_path) {
   }
   log_debug(logger, "Loaded library handle: %p", runtime->_handle);
 
+  // Tensors handed over to or by an isolated instance live in the heap of
+  // its own C library
+  if (isolated) {
+    runtime->allocate = get_symbol_address(runtime->_handle, "malloc");
+    runtime->deallocate = get_symbol_address(runtime->_handle, "free");
+  } else {
+    runtime->allocate = malloc;
+    runtime->deallocate = free;
+  }
+  if (runtime->allocate == NULL || runtime->deallocate == NULL) {
+    destroy_runtime(runtime);
+    log_error(logger, "Failed to load the allocator of the runtime: %s.",
+              DL_ERROR);
+    return NULL;
+  }
+
   runtime->runtime_initialization =
       get_symbol_address(runtime->_handle, "runtime_initialization");
   if (runtime->runtime_initialization == NULL) {
@@ -178,30 +211,484 @@ Runtime *initialize_runtime(const char *library_path) {
   return runtime;
 }
 
+Runtime *initialize_runtime(const char *library_path) {
+  return load_runtime(library_path, false);
+}
+
+// Atomic updates of the in-flight counters, shared by the sending and the
+// receiving threads
+#ifdef _WIN32
+#define IN_FLIGHT_ADD(counter, value) \
+  InterlockedExchangeAdd((volatile LONG *)(counter), (value))
+#define IN_FLIGHT_LOAD(counter) \
+  InterlockedCompareExchange((volatile LONG *)(counter), 0, 0)
+#else
+#define IN_FLIGHT_ADD(counter, value) \
+  __atomic_fetch_add((counter), (value), __ATOMIC_RELAXED)
+#define IN_FLIGHT_LOAD(counter) __atomic_load_n((counter), __ATOMIC_RELAXED)
+#endif
+
+RuntimeGroup *initialize_runtime_group(const char *library_path,
+                                       size_t num_instances) {
+  RuntimeGroup *group = (RuntimeGroup *)calloc(1, sizeof(RuntimeGroup));
+  if (group == NULL) {
+    log_error(logger, "Failed to allocate memory for RuntimeGroup.");
+    return NULL;
+  }
+  group->runtimes = (Runtime **)calloc(num_instances, sizeof(Runtime *));
+  group->in_flight = (long *)calloc(num_instances, sizeof(long));
+  if (group->runtimes == NULL || group->in_flight == NULL) {
+    log_error(logger, "Failed to allocate memory for RuntimeGroup.");
+    destroy_runtime_group(group);
+    return NULL;
+  }
+  for (size_t i = 0; i < num_instances; i++) {
+    // A single instance is loaded like any other library
+    group->runtimes[i] = load_runtime(library_path, num_instances > 1);
+    if (group->runtimes[i] == NULL) {
+      log_error(logger, "Failed to load runtime instance %zu.", i);
+      destroy_runtime_group(group);
+      return NULL;
+    }
+    group->num_runtimes++;
+  }
+  return group;
+}
+
+void destroy_runtime_group(RuntimeGroup *group) {
+  if (group == NULL) return;
+  for (size_t i = 0; i < group->num_runtimes; i++) {
+    destroy_runtime(group->runtimes[i]);
+  }
+  free(group->runtimes);
+  free(group->in_flight);
+  free(group);
+}
+
+size_t least_loaded_runtime(RuntimeGroup *group) {
+  size_t best = 0;
+  long best_in_flight = IN_FLIGHT_LOAD(&group->in_flight[0]);
+  for (size_t i = 1; i < group->num_runtimes; i++) {
+    long in_flight = IN_FLIGHT_LOAD(&group->in_flight[i]);
+    if (in_flight < best_in_flight) {
+      best = i;
+      best_in_flight = in_flight;
+    }
+  }
+  return best;
+}
+
+int runtime_group_send_input(RuntimeGroup *group, size_t instance,
+                             tensors_struct *input_tensors) {
+  IN_FLIGHT_ADD(&group->in_flight[instance], 1);
+  int code = group->runtimes[instance]->send_input(input_tensors);
+  if (code != 0) {
+    IN_FLIGHT_ADD(&group->in_flight[instance], -1);
+  }
+  return code;
+}
+
+int runtime_group_receive_output(RuntimeGroup *group,
+                                 tensors_struct **output_tensors,
+                                 size_t *instance) {
+  for (size_t k = 0; k < group->num_runtimes; k++) {
+    size_t i = (group->next_to_poll + k) % group->num_runtimes;
+    if (group->runtimes[i]->receive_output(output_tensors) == 0) {
+      IN_FLIGHT_ADD(&group->in_flight[i], -1);
+      // Start with the next instance, to be fair across instances
+      group->next_to_poll = (i + 1) % group->num_runtimes;
+      *instance = i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Resampling taps of one axis, in compressed rows: output i reads the source
+// samples indices[starts[i]] .. indices[starts[i + 1] - 1], in increasing
+// order, with the matching weights
+typedef struct ResizeTaps {
+  int *starts;
+  int *indices;
+  float *weights;
+} ResizeTaps;
+
+static void free_resize_taps(ResizeTaps *taps) {
+  free(taps->starts);
+  free(taps->indices);
+  free(taps->weights);
+  taps->starts = NULL;
+  taps->indices = NULL;
+  taps->weights = NULL;
+}
+
+static bool compute_resize_taps(int src_size, int dst_size,
+                                ResizeInterpolation interpolation,
+                                ResizeTaps *taps) {
+  double ratio = (double)src_size / dst_size;
+  // Area averaging only makes sense when downscaling
+  if (interpolation == RESIZE_AREA && ratio <= 1.0) {
+    interpolation = RESIZE_BILINEAR;
+  }
+  int max_taps = 1;
+  if (interpolation == RESIZE_BILINEAR) max_taps = 2;
+  if (interpolation == RESIZE_AREA) max_taps = (int)ceil(ratio) + 1;
+
+  taps->starts = (int *)malloc((dst_size + 1) * sizeof(int));
+  taps->indices = (int *)malloc((size_t)dst_size * max_taps * sizeof(int));
+  taps->weights = (float *)malloc((size_t)dst_size * max_taps * sizeof(float));
+  if (taps->starts == NULL || taps->indices == NULL || taps->weights == NULL) {
+    free_resize_taps(taps);
+    return false;
+  }
+
+  int n = 0;
+  for (int i = 0; i < dst_size; i++) {
+    taps->starts[i] = n;
+    if (interpolation == RESIZE_NEAREST) {
+      taps->indices[n] = (int)(i * ratio);
+      taps->weights[n++] = 1.0f;
+    } else if (interpolation == RESIZE_BILINEAR) {
+      // Align pixel centers, like OpenCV's INTER_LINEAR
+      double center = (i + 0.5) * ratio - 0.5;
+      int i0 = (int)floor(center);
+      float fraction = (float)(center - i0);
+      if (i0 < 0) {
+        i0 = 0;
+        fraction = 0.0f;
+      }
+      if (i0 >= src_size - 1) {
+        i0 = src_size - 1;
+        fraction = 0.0f;
+      }
+      taps->indices[n] = i0;
+      taps->weights[n++] = 1.0f - fraction;
+      if (fraction > 0.0f) {
+        taps->indices[n] = i0 + 1;
+        taps->weights[n++] = fraction;
+      }
+    } else {
+      // Box filter: weight every source sample by its coverage
+      double start = i * ratio;
+      double end = start + ratio;
+      for (int s = (int)floor(start); s < end && s < src_size; s++) {
+        double coverage = fmin(end, s + 1.0) - fmax(start, (double)s);
+        if (coverage <= 1e-6) continue;
+        taps->indices[n] = s;
+        taps->weights[n++] = (float)(coverage / ratio);
+      }
+    }
+  }
+  taps->starts[dst_size] = n;
+  return true;
+}
+
+// Row kernels of the resizer, vectorized with SSE2 or NEON
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define RESIZE_USE_SSE2
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define RESIZE_USE_NEON
+#endif
+
+// dst = weight * src, or dst += weight * src when accumulating
+static void scale_add_row(float *dst, const float *src, float weight, int n,
+                          bool accumulate) {
+  int i = 0;
+#if defined(RESIZE_USE_SSE2)
+  __m128 w = _mm_set1_ps(weight);
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), w);
+    if (accumulate) v = _mm_add_ps(_mm_loadu_ps(dst + i), v);
+    _mm_storeu_ps(dst + i, v);
+  }
+#elif defined(RESIZE_USE_NEON)
+  float32x4_t w = vdupq_n_f32(weight);
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vmulq_f32(vld1q_f32(src + i), w);
+    if (accumulate) v = vaddq_f32(vld1q_f32(dst + i), v);
+    vst1q_f32(dst + i, v);
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = accumulate ? dst[i] + weight * src[i] : weight * src[i];
+  }
+}
+
+// dst = (src - mean) / std, as a multiply by inv_std = 1 / std, which ARMv7
+// NEON has no vector division for
+static void normalize_row(float *dst, const float *src, int n, float mean,
+                          float inv_std) {
+  int i = 0;
+#if defined(RESIZE_USE_SSE2)
+  __m128 m = _mm_set1_ps(mean);
+  __m128 s = _mm_set1_ps(inv_std);
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i), m), s));
+  }
+#elif defined(RESIZE_USE_NEON)
+  float32x4_t m = vdupq_n_f32(mean);
+  float32x4_t s = vdupq_n_f32(inv_std);
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(dst + i, vmulq_f32(vsubq_f32(vld1q_f32(src + i), m), s));
+  }
+#endif
+  for (; i < n; i++) dst[i] = (src[i] - mean) * inv_std;
+}
+
+// Split a row of n 3-channel pixels into the rows of three planes, normalized
+// as in `normalize_row`. Four pixels are deinterleaved at a time.
+static void deinterleave_normalize_row(float *planes[3], const float *src,
+                                       int n, float mean, float inv_std) {
+  int i = 0;
+#if defined(RESIZE_USE_SSE2)
+  __m128 m = _mm_set1_ps(mean);
+  __m128 s = _mm_set1_ps(inv_std);
+  for (; i + 4 <= n; i += 4) {
+    // a = p0c0 p0c1 p0c2 p1c0, b = p1c1 p1c2 p2c0 p2c1, c = p2c2 p3c0 p3c1 p3c2
+    __m128 a = _mm_loadu_ps(src + 3 * i);
+    __m128 b = _mm_loadu_ps(src + 3 * i + 4);
+    __m128 c = _mm_loadu_ps(src + 3 * i + 8);
+    __m128 b2c1 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));
+    __m128 a1b0 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));
+    __m128 b3c2 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3));
+    __m128 a2b1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));
+    __m128 c0c3 = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0));
+    __m128 c0 = _mm_shuffle_ps(a, b2c1, _MM_SHUFFLE(2, 0, 3, 0));
+    __m128 c1 = _mm_shuffle_ps(a1b0, b3c2, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 c2 = _mm_shuffle_ps(a2b1, c0c3, _MM_SHUFFLE(2, 0, 2, 0));
+    _mm_storeu_ps(planes[0] + i, _mm_mul_ps(_mm_sub_ps(c0, m), s));
+    _mm_storeu_ps(planes[1] + i, _mm_mul_ps(_mm_sub_ps(c1, m), s));
+    _mm_storeu_ps(planes[2] + i, _mm_mul_ps(_mm_sub_ps(c2, m), s));
+  }
+#elif defined(RESIZE_USE_NEON)
+  float32x4_t m = vdupq_n_f32(mean);
+  float32x4_t s = vdupq_n_f32(inv_std);
+  for (; i + 4 <= n; i += 4) {
+    float32x4x3_t pixels = vld3q_f32(src + 3 * i);
+    for (int c = 0; c < 3; c++) {
+      vst1q_f32(planes[c] + i, vmulq_f32(vsubq_f32(pixels.val[c], m), s));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    for (int c = 0; c < 3; c++) {
+      planes[c][i] = (src[3 * i + c] - mean) * inv_std;
+    }
+  }
+}
+
+// Separable resizer fed one source row at a time. Each row is resized
+// horizontally into a small ring of cached rows; as soon as the last source
+// row of an output row has arrived, the cached rows are blended vertically,
+// normalized and stored in the output tensor.
+typedef struct RowResizer {
+  int width;
+  int new_width;
+  int new_height;
+  int channels;
+  float mean;
+  float inv_std;  // 1 / std
+  bool nchw;
+  float *output;
+
+  ResizeTaps x_taps;
+  ResizeTaps y_taps;
+  // Horizontally resized rows, indexed by source row modulo the window size
+  int window;
+  float *rows;
+  // Vertically blended row
+  float *blended;
+  // Next output row to produce
+  int next_row;
+} RowResizer;
+
+static void destroy_row_resizer(RowResizer *resizer) {
+  free_resize_taps(&resizer->x_taps);
+  free_resize_taps(&resizer->y_taps);
+  free(resizer->rows);
+  free(resizer->blended);
+  resizer->rows = NULL;
+  resizer->blended = NULL;
+}
+
+static bool init_row_resizer(RowResizer *resizer, int width, int height,
+                             int new_width, int new_height, int channels,
+                             ResizeInterpolation interpolation, float mean,
+                             float std, bool nchw, float *output) {
+  memset(resizer, 0, sizeof(RowResizer));
+  resizer->width = width;
+  resizer->new_width = new_width;
+  resizer->new_height = new_height;
+  resizer->channels = channels;
+  resizer->mean = mean;
+  resizer->inv_std = 1.0f / std;
+  resizer->nchw = nchw;
+  resizer->output = output;
+
+  if (!compute_resize_taps(width, new_width, interpolation,
+                           &resizer->x_taps) ||
+      !compute_resize_taps(height, new_height, interpolation,
+                           &resizer->y_taps)) {
+    destroy_row_resizer(resizer);
+    return false;
+  }
+  // The window must hold every source row of any single output row
+  const ResizeTaps *y_taps = &resizer->y_taps;
+  resizer->window = 1;
+  for (int y = 0; y < new_height; y++) {
+    int first = y_taps->indices[y_taps->starts[y]];
+    int last = y_taps->indices[y_taps->starts[y + 1] - 1];
+    if (last - first + 1 > resizer->window) resizer->window = last - first + 1;
+  }
+
+  size_t row_size = (size_t)new_width * channels;
+  resizer->rows = (float *)malloc(resizer->window * row_size * sizeof(float));
+  resizer->blended = (float *)malloc(row_size * sizeof(float));
+  if (resizer->rows == NULL || resizer->blended == NULL) {
+    destroy_row_resizer(resizer);
+    return false;
+  }
+  return true;
+}
+
+// Store a resized row as row `y` of the output tensor, in NCHW or NHWC layout
+static void store_output_row(RowResizer *resizer, int y, const float *row) {
+  int new_width = resizer->new_width;
+  int channels = resizer->channels;
+  if (!resizer->nchw) {
+    normalize_row(&resizer->output[(size_t)y * new_width * channels], row,
+                  new_width * channels, resizer->mean, resizer->inv_std);
+    return;
+  }
+  size_t plane_size = (size_t)new_width * resizer->new_height;
+  if (channels == 3) {
+    float *planes[3];
+    for (int c = 0; c < 3; c++) {
+      planes[c] = &resizer->output[c * plane_size + (size_t)y * new_width];
+    }
+    deinterleave_normalize_row(planes, row, new_width, resizer->mean,
+                               resizer->inv_std);
+    return;
+  }
+  for (int c = 0; c < channels; c++) {
+    float *plane_row =
+        &resizer->output[c * plane_size + (size_t)y * new_width];
+    for (int x = 0; x < new_width; x++) {
+      plane_row[x] = (row[x * channels + c] - resizer->mean) * resizer->inv_std;
+    }
+  }
+}
+
+// Resize a source row horizontally with the column taps. A pixel of 3
+// channels accumulates its taps in the first three lanes of a vector.
+static void resize_source_row(float *row, const unsigned char *src_row,
+                              const ResizeTaps *x_taps, int new_width,
+                              int channels) {
+  int x = 0;
+#if defined(RESIZE_USE_SSE2) || defined(RESIZE_USE_NEON)
+  // The 4th lane is stored over the first channel of the next pixel, which
+  // overwrites it, so the last pixel is left to the scalar loop
+  for (; channels == 3 && x + 1 < new_width; x++) {
+#if defined(RESIZE_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128 sum = _mm_setzero_ps();
+    for (int t = x_taps->starts[x]; t < x_taps->starts[x + 1]; t++) {
+      const unsigned char *src = &src_row[x_taps->indices[t] * 3];
+      __m128i bytes = _mm_cvtsi32_si128(src[0] | src[1] << 8 | src[2] << 16);
+      __m128 pixel = _mm_cvtepi32_ps(
+          _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+      sum = _mm_add_ps(sum, _mm_mul_ps(pixel, _mm_set1_ps(x_taps->weights[t])));
+    }
+    _mm_storeu_ps(&row[x * 3], sum);
+#else
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (int t = x_taps->starts[x]; t < x_taps->starts[x + 1]; t++) {
+      const unsigned char *src = &src_row[x_taps->indices[t] * 3];
+      uint8x8_t bytes = vcreate_u8(src[0] | src[1] << 8 | src[2] << 16);
+      float32x4_t pixel =
+          vcvtq_f32_u32(vmovl_u16(vget_low_u16(vmovl_u8(bytes))));
+      sum = vmlaq_n_f32(sum, pixel, x_taps->weights[t]);
+    }
+    vst1q_f32(&row[x * 3], sum);
+#endif
+  }
+#endif
+  for (; x < new_width; x++) {
+    float *pixel = &row[x * channels];
+    for (int c = 0; c < channels; c++) pixel[c] = 0.0f;
+    for (int t = x_taps->starts[x]; t < x_taps->starts[x + 1]; t++) {
+      const unsigned char *src = &src_row[x_taps->indices[t] * channels];
+      float weight = x_taps->weights[t];
+      for (int c = 0; c < channels; c++) pixel[c] += weight * src[c];
+    }
+  }
+}
+
+// Feed source row `src_y`. Rows must be pushed in increasing order.
+static void push_source_row(RowResizer *resizer, const unsigned char *src_row,
+                            int src_y) {
+  const ResizeTaps *x_taps = &resizer->x_taps;
+  const ResizeTaps *y_taps = &resizer->y_taps;
+  int new_width = resizer->new_width;
+  int channels = resizer->channels;
+  int row_size = new_width * channels;
+  if (resizer->next_row >= resizer->new_height) return;
+
+  // Skip source rows that no remaining output row reads
+  int first_needed = y_taps->indices[y_taps->starts[resizer->next_row]];
+  if (src_y < first_needed) return;
+
+  // Horizontal pass with the precomputed column taps
+  float *row = &resizer->rows[(size_t)(src_y % resizer->window) * row_size];
+  resize_source_row(row, src_row, x_taps, new_width, channels);
+
+  // Vertical pass for every output row whose last source row has arrived
+  while (resizer->next_row < resizer->new_height) {
+    int y = resizer->next_row;
+    int begin = y_taps->starts[y];
+    int end = y_taps->starts[y + 1];
+    if (y_taps->indices[end - 1] > src_y) break;
+
+    const float *blended =
+        &resizer->rows[(size_t)(y_taps->indices[begin] % resizer->window) *
+                       row_size];
+    if (end - begin > 1 || y_taps->weights[begin] != 1.0f) {
+      for (int t = begin; t < end; t++) {
+        const float *cached =
+            &resizer->rows[(size_t)(y_taps->indices[t] % resizer->window) *
+                           row_size];
+        scale_add_row(resizer->blended, cached, y_taps->weights[t], row_size,
+                      t > begin);
+      }
+      blended = resizer->blended;
+    }
+    store_output_row(resizer, y, blended);
+    resizer->next_row++;
+  }
+}
+
 void resize_image(const unsigned char *image, int width, int height,
                   int new_width, int new_height, float *resized_image) {
   if (image == NULL) return;
   if (resized_image == NULL) return;
 
   // Simple resizing algorithm: nearest neighbor interpolation
-  double x_ratio = (double)width / new_width;
-  double y_ratio = (double)height / new_height;
-
-  for (int y = 0; y < new_height; y++) {
-    for (int x = 0; x < new_width; x++) {
-      int px = (int)(x * x_ratio);
-      int py = (int)(y * y_ratio);
-      resized_image[(y * new_width + x) * 3] = image[(py * width + px) * 3];
-      resized_image[(y * new_width + x) * 3 + 1] =
-          image[(py * width + px) * 3 + 1];
-      resized_image[(y * new_width + x) * 3 + 2] =
-          image[(py * width + px) * 3 + 2];
-    }
+  RowResizer resizer;
+  if (!init_row_resizer(&resizer, width, height, new_width, new_height, 3,
+                        RESIZE_NEAREST, 0.0f, 1.0f, false, resized_image)) {
+    return;
   }
+  for (int y = 0; y < height; y++) {
+    push_source_row(&resizer, &image[(size_t)y * width * 3], y);
+  }
+  destroy_row_resizer(&resizer);
 }
 
 void *load_image(const char *image_path, int new_width, int new_height,
-                 float mean, float std, bool nchw) {
+                 float mean, float std, bool nchw,
+                 ResizeInterpolation interpolation) {
   FILE *input_file = fopen(image_path, "rb");
   if (!input_file) {
     log_error(logger, "Error: Couldn't open the image file.");
@@ -214,52 +701,64 @@ void *load_image(const char *image_path, int new_width, int new_height,
   jpeg_create_decompress(&cinfo);
   jpeg_stdio_src(&cinfo, input_file);
   jpeg_read_header(&cinfo, TRUE);
+
+  // Let libjpeg downscale in the DCT domain: pick the largest 1/2, 1/4 or 1/8
+  // reduction that still covers the target size
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1;
+  for (unsigned int denom = 8; denom > 1; denom /= 2) {
+    if (cinfo.image_width / denom >= (JDIMENSION)new_width &&
+        cinfo.image_height / denom >= (JDIMENSION)new_height) {
+      cinfo.scale_denom = denom;
+      break;
+    }
+  }
+  log_debug(logger, "Decoding %ux%u JPEG at 1/%u scale.", cinfo.image_width,
+            cinfo.image_height, cinfo.scale_denom);
   jpeg_start_decompress(&cinfo);
 
   int width = cinfo.output_width;
   int height = cinfo.output_height;
   int num_channels = cinfo.output_components;
 
-  unsigned char *image = (unsigned char *)malloc(width * height * num_channels *
-                                                 sizeof(unsigned char));
+  // The decoded image is streamed one scanline at a time: each scanline is
+  // resized and normalized straight into the output tensor, so only a few
+  // source rows are ever held in memory.
+  unsigned char *row =
+      (unsigned char *)malloc(width * num_channels * sizeof(unsigned char));
   float *resized_image =
       (float *)malloc(new_height * new_width * num_channels * sizeof(float));
+  RowResizer resizer;
+  if (row == NULL || resized_image == NULL ||
+      !init_row_resizer(&resizer, width, height, new_width, new_height,
+                        num_channels, interpolation, mean, std, nchw,
+                        resized_image)) {
+    log_error(logger, "Failed to allocate memory for the image.");
+    free(row);
+    free(resized_image);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(input_file);
+    return NULL;
+  }
 
-  while (cinfo.output_scanline < cinfo.output_height) {
-    unsigned char *row = &image[cinfo.output_scanline * cinfo.output_width *
-                                cinfo.output_components];
+  while (cinfo.output_scanline < cinfo.output_height &&
+         resizer.next_row < new_height) {
+    int y = (int)cinfo.output_scanline;
     jpeg_read_scanlines(&cinfo, &row, 1);
+    push_source_row(&resizer, row, y);
   }
 
-  jpeg_finish_decompress(&cinfo);
+  // The bottom scanlines may not be needed by any output row
+  if (cinfo.output_scanline < cinfo.output_height) {
+    jpeg_abort_decompress(&cinfo);
+  } else {
+    jpeg_finish_decompress(&cinfo);
+  }
   jpeg_destroy_decompress(&cinfo);
   fclose(input_file);
 
-  // resize and convert the image to float
-  resize_image(image, width, height, new_width, new_height, resized_image);
-
-  // Normalize the image
-  for (int i = 0; i < new_height * new_width * num_channels; i++)
-    resized_image[i] = (resized_image[i] - mean) / std;
-
-  // Convert to NCHW format
-  if (nchw) {
-    float *transposed_image =
-        (float *)malloc(new_height * new_width * num_channels * sizeof(float));
-    for (int c = 0; c < num_channels; c++) {
-      for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-          transposed_image[c * new_height * new_width + y * new_width + x] =
-              resized_image[y * new_width * num_channels + x * num_channels +
-                            c];
-        }
-      }
-    }
-    free(resized_image);
-    resized_image = transposed_image;
-  }
-
-  free(image);
+  destroy_row_resizer(&resizer);
+  free(row);
   return (void *)resized_image;
 }
 
@@ -309,3 +808,360 @@ tensors_struct *build_tensors_struct(uint8_t *data, size_t height, size_t width,
 
   return input_tensors;
 }
+
+// Size in bytes of the data of the i-th tensor, 0 if the data type is unknown
+static size_t tensor_size_in_bytes(const tensors_struct *tensors, size_t i) {
+  size_t size;
+  switch (tensors->data_types[i]) {
+    case DATA_TYPE_FLOAT:
+      size = sizeof(float);
+      break;
+    case DATA_TYPE_UINT8:
+    case DATA_TYPE_INT8:
+      size = sizeof(uint8_t);
+      break;
+    default:
+      return 0;
+  }
+  for (size_t d = 0; d < tensors->ranks[i]; d++) {
+    size *= tensors->shapes[i][d];
+  }
+  return size;
+}
+
+// Memory of `size` bytes from the allocator of the runtime, zeroed
+static void *allocate_zeroed(const Runtime *runtime, size_t size) {
+  void *pointer = runtime->allocate(size > 0 ? size : 1);
+  if (pointer != NULL) {
+    memset(pointer, 0, size);
+  }
+  return pointer;
+}
+
+tensors_struct *copy_tensors_for_runtime(const Runtime *runtime,
+                                         const tensors_struct *tensors) {
+  const size_t n = tensors->num_tensors;
+  tensors_struct *copy =
+      (tensors_struct *)allocate_zeroed(runtime, sizeof(tensors_struct));
+  if (copy == NULL) {
+    log_error(logger, "Failed to allocate memory for the tensors copy.");
+    return NULL;
+  }
+  // Zeroed, so that a partial copy can be freed
+  copy->num_tensors = n;
+  copy->names = (char **)allocate_zeroed(runtime, n * sizeof(char *));
+  copy->data_types = (tensor_data_type *)allocate_zeroed(
+      runtime, n * sizeof(tensor_data_type));
+  copy->ranks = (size_t *)allocate_zeroed(runtime, n * sizeof(size_t));
+  copy->shapes = (size_t **)allocate_zeroed(runtime, n * sizeof(size_t *));
+  copy->data = (void **)allocate_zeroed(runtime, n * sizeof(void *));
+  bool failed = copy->names == NULL || copy->data_types == NULL ||
+                copy->ranks == NULL || copy->shapes == NULL ||
+                copy->data == NULL;
+  for (size_t i = 0; i < n && !failed; i++) {
+    const size_t name_size = strlen(tensors->names[i]) + 1;
+    const size_t shape_size = tensors->ranks[i] * sizeof(size_t);
+    const size_t data_size = tensor_size_in_bytes(tensors, i);
+    copy->names[i] = (char *)allocate_zeroed(runtime, name_size);
+    copy->shapes[i] = (size_t *)allocate_zeroed(runtime, shape_size);
+    copy->data[i] = allocate_zeroed(runtime, data_size);
+    if (data_size == 0 || copy->names[i] == NULL || copy->shapes[i] == NULL ||
+        copy->data[i] == NULL) {
+      failed = true;
+      break;
+    }
+    memcpy(copy->names[i], tensors->names[i], name_size);
+    copy->data_types[i] = tensors->data_types[i];
+    copy->ranks[i] = tensors->ranks[i];
+    memcpy(copy->shapes[i], tensors->shapes[i], shape_size);
+    memcpy(copy->data[i], tensors->data[i], data_size);
+  }
+  if (failed) {
+    log_error(logger, "Failed to copy the tensors for the runtime.");
+    free_runtime_tensors(runtime, copy);
+    return NULL;
+  }
+  return copy;
+}
+
+void free_runtime_tensors(const Runtime *runtime, tensors_struct *tensors) {
+  if (tensors == NULL) return;
+  for (size_t i = 0; i < tensors->num_tensors; i++) {
+    if (tensors->names != NULL) runtime->deallocate(tensors->names[i]);
+    if (tensors->shapes != NULL) runtime->deallocate(tensors->shapes[i]);
+    if (tensors->data != NULL) runtime->deallocate(tensors->data[i]);
+  }
+  runtime->deallocate(tensors->names);
+  runtime->deallocate(tensors->data_types);
+  runtime->deallocate(tensors->ranks);
+  runtime->deallocate(tensors->shapes);
+  runtime->deallocate(tensors->data);
+  runtime->deallocate(tensors);
+}
+
+void print_tensors_data(const tensors_struct *tensors, size_t max_elements) {
+  for (size_t i = 0; i < tensors->num_tensors; i++) {
+    size_t count = 1;
+    for (size_t d = 0; d < tensors->ranks[i]; d++) {
+      count *= tensors->shapes[i][d];
+    }
+    log_info(logger, "Tensor %zu (%s): %zu element(s)", i, tensors->names[i],
+             count);
+    if (tensor_size_in_bytes(tensors, i) == 0 || tensors->data[i] == NULL) {
+      log_warning(logger, "Tensor %zu has an unsupported data type: %d.", i,
+                  (int)tensors->data_types[i]);
+      continue;
+    }
+    if (count > max_elements) {
+      count = max_elements;
+    }
+    for (size_t j = 0; j < count; j++) {
+      switch (tensors->data_types[i]) {
+        case DATA_TYPE_FLOAT:
+          printf("%f ", ((const float *)tensors->data[i])[j]);
+          break;
+        case DATA_TYPE_UINT8:
+          printf("%u ", ((const uint8_t *)tensors->data[i])[j]);
+          break;
+        case DATA_TYPE_INT8:
+          printf("%d ", ((const int8_t *)tensors->data[i])[j]);
+          break;
+        default:
+          break;
+      }
+      if (j % 6 == 5 || j == count - 1) {  // Print a new line every 6 elements
+        printf("\n");
+      }
+    }
+  }
+}
+
+uint64_t monotonic_time_us(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+                    counter.QuadPart % frequency.QuadPart * 1000000 /
+                        frequency.QuadPart);
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+#endif
+}
+
+// Hint the CPU that we are busy waiting
+static void cpu_relax(void) {
+#if defined(_WIN32)
+  YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static void yield_thread(void) {
+#ifdef _WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+static void sleep_us(unsigned int microseconds) {
+#ifdef _WIN32
+  Sleep((microseconds + 999) / 1000);  // Millisecond granularity
+#else
+  struct timespec duration = {microseconds / 1000000,
+                              (long)(microseconds % 1000000) * 1000};
+  nanosleep(&duration, NULL);
+#endif
+}
+
+void init_output_poller(OutputPoller *poller, RuntimeGroup *runtimes) {
+  poller->runtimes = runtimes;
+  poller->spin_polls = 100;
+  poller->yield_polls = 100;
+  poller->min_sleep_us = 10;
+  poller->max_sleep_us = 500;
+}
+
+int poll_output(OutputPoller *poller, tensors_struct **output_tensors,
+                size_t *instance, unsigned int timeout_ms) {
+  const uint64_t deadline = monotonic_time_us() + timeout_ms * 1000ULL;
+  unsigned int sleep = poller->min_sleep_us;
+  for (int polls = 0;; polls++) {
+    if (runtime_group_receive_output(poller->runtimes, output_tensors,
+                                     instance) == 0) {
+      return 0;
+    }
+    if (monotonic_time_us() >= deadline) {
+      return 1;
+    }
+    // Spin, then yield, then sleep with an exponential backoff
+    if (polls < poller->spin_polls) {
+      cpu_relax();
+    } else if (polls < poller->spin_polls + poller->yield_polls) {
+      yield_thread();
+    } else {
+      sleep_us(sleep);
+      sleep = sleep * 2 < poller->max_sleep_us ? sleep * 2
+                                                : poller->max_sleep_us;
+    }
+  }
+}
+
+int run_output_poller(OutputPoller *poller, int count, OutputCallback callback,
+                      void *user_data, unsigned int timeout_ms) {
+  int received = 0;
+  while (received < count) {
+    tensors_struct *output_tensors = NULL;
+    size_t instance = 0;
+    if (poll_output(poller, &output_tensors, &instance, timeout_ms) != 0) {
+      break;
+    }
+    callback(output_tensors, instance, user_data);
+    received++;
+  }
+  return received;
+}
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+// Read an integer from a sysfs file, returns 0 on success
+static int read_sys_int(const char *path, int *value) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return 1;
+  int code = fscanf(file, "%d", value) == 1 ? 0 : 1;
+  fclose(file);
+  return code;
+}
+
+static int compare_cores(const void *a, const void *b) {
+  const PhysicalCore *x = (const PhysicalCore *)a;
+  const PhysicalCore *y = (const PhysicalCore *)b;
+  if (x->package != y->package) return (x->package > y->package) ? 1 : -1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+// Group the CPUs the process may run on by physical core. Without topology
+// in sysfs, every CPU counts as a core of its own.
+static int read_cpu_topology(AffinityPlan *plan) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 1;
+  plan->cores = (PhysicalCore *)calloc(CPU_COUNT(&allowed),
+                                       sizeof(PhysicalCore));
+  if (plan->cores == NULL) return 1;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    char path[128];
+    int package = -1, id = cpu;
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+             cpu);
+    if (read_sys_int(path, &package) == 0) {
+      snprintf(path, sizeof(path),
+               "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+      if (read_sys_int(path, &id) != 0) {
+        package = -1;
+        id = cpu;
+      }
+    }
+    size_t c = 0;
+    while (c < plan->num_cores &&
+           (plan->cores[c].package != package || plan->cores[c].id != id)) {
+      c++;
+    }
+    PhysicalCore *core = &plan->cores[c];
+    if (c == plan->num_cores) {
+      core->package = package;
+      core->id = id;
+      plan->num_cores++;
+    }
+    if (core->num_cpus < MAX_CPUS_PER_CORE) {
+      core->cpus[core->num_cpus++] = cpu;
+    }
+  }
+  qsort(plan->cores, plan->num_cores, sizeof(PhysicalCore), compare_cores);
+  return 0;
+}
+#endif
+
+int plan_affinity(AffinityPlan *plan, size_t num_instances,
+                  int threads_per_duplicate) {
+  memset(plan, 0, sizeof(AffinityPlan));
+  plan->receive_core = -1;
+  plan->send_core = -1;
+  plan->n_duplicates = 1;
+  plan->n_threads_per_duplicate = 1;
+#if defined(__linux__) && defined(_GNU_SOURCE)
+  if (read_cpu_topology(plan) != 0) {
+    log_warning(logger, "Failed to read the CPU topology.");
+    return 1;
+  }
+  // A core for each of the two threads, and at least one per instance
+  if (plan->num_cores < num_instances + 2) {
+    log_warning(logger,
+                "Threads left unpinned: %zu core(s) for %zu runtime "
+                "instance(s) and 2 threads.",
+                plan->num_cores, num_instances);
+    return 1;
+  }
+  // The threads take the last cores, away from CPU 0 that usually serves the
+  // interrupts
+  plan->receive_core = (int)plan->num_cores - 1;
+  plan->send_core = (int)plan->num_cores - 2;
+  plan->cores_per_runtime = (plan->num_cores - 2) / num_instances;
+  // One compute thread per physical core of the instance
+  int cores = (int)plan->cores_per_runtime;
+  plan->n_threads_per_duplicate = cores;
+  if (threads_per_duplicate > 0 && threads_per_duplicate < cores) {
+    plan->n_threads_per_duplicate = threads_per_duplicate;
+  }
+  plan->n_duplicates = cores / plan->n_threads_per_duplicate;
+  log_info(logger,
+           "Affinity: %zu core(s), %zu per runtime instance with %d "
+           "duplicate(s) of %d thread(s)",
+           plan->num_cores, plan->cores_per_runtime, plan->n_duplicates,
+           plan->n_threads_per_duplicate);
+  return 0;
+#else
+  (void)num_instances;
+  (void)threads_per_duplicate;
+  log_warning(logger, "Pinning threads is only supported on Linux.");
+  return 1;
+#endif
+}
+
+void destroy_affinity_plan(AffinityPlan *plan) {
+  free(plan->cores);
+  plan->cores = NULL;
+  plan->num_cores = 0;
+}
+
+int pin_thread_to_cores(const AffinityPlan *plan, size_t first_core,
+                        size_t count) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+  if (first_core + count > plan->num_cores) return 1;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (size_t c = first_core; c < first_core + count; c++) {
+    for (size_t i = 0; i < plan->cores[c].num_cpus; i++) {
+      CPU_SET(plan->cores[c].cpus[i], &cpus);
+    }
+  }
+  int code = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (code != 0) {
+    log_warning(logger, "Failed to pin a thread to %zu core(s): %s", count,
+                strerror(code));
+  }
+  return code;
+#else
+  (void)plan;
+  (void)first_core;
+  (void)count;
+  return 1;
+#endif
+}
@@ -0,0 +1,122 @@
+// Copyright (c) OAAX. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+// Description: Mock OAAX runtime for the tests, built as a shared library and
+// loaded like any runtime. Every input sent comes back unchanged as the output
+// of its request once the completion delay has passed, in send order.
+//
+// Arguments of runtime_initialization_with_args:
+//   "completion_delay_us": const int *, time from a send to its output
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tensors_struct.h"  // NOLINT[build/include]
+
+// Request in flight, in a FIFO queue
+typedef struct Request {
+  tensors_struct *tensors;
+  uint64_t ready_at_us;
+  struct Request *next;
+} Request;
+
+static pthread_mutex_t requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Request *first_request = NULL;
+static Request *last_request = NULL;
+static uint64_t completion_delay_us = 1000;
+
+static uint64_t now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_nsec / 1000u;
+}
+
+static void free_tensors(tensors_struct *tensors) {
+  for (size_t i = 0; i < tensors->num_tensors; i++) {
+    free(tensors->names[i]);
+    free(tensors->shapes[i]);
+    free(tensors->data[i]);
+  }
+  free(tensors->names);
+  free(tensors->data_types);
+  free(tensors->ranks);
+  free(tensors->shapes);
+  free(tensors->data);
+  free(tensors);
+}
+
+int runtime_initialization(void) { return 0; }
+
+int runtime_initialization_with_args(int length, const char **keys,
+                                     const void **values) {
+  for (int i = 0; i < length; i++) {
+    if (strcmp(keys[i], "completion_delay_us") == 0) {
+      completion_delay_us = (uint64_t)(*(const int *)values[i]);
+    }
+  }
+  return 0;
+}
+
+int runtime_model_loading(const char *file_path) {
+  (void)file_path;
+  return 0;
+}
+
+int send_input(tensors_struct *input_tensors) {
+  if (input_tensors == NULL) {
+    return 1;
+  }
+  Request *request = (Request *)malloc(sizeof(Request));
+  if (request == NULL) {
+    return 1;
+  }
+  request->tensors = input_tensors;
+  request->next = NULL;
+  pthread_mutex_lock(&requests_mutex);
+  request->ready_at_us = now_us() + completion_delay_us;
+  if (last_request == NULL) {
+    first_request = request;
+  } else {
+    last_request->next = request;
+  }
+  last_request = request;
+  pthread_mutex_unlock(&requests_mutex);
+  return 0;
+}
+
+int receive_output(tensors_struct **output_tensors) {
+  pthread_mutex_lock(&requests_mutex);
+  Request *request = first_request;
+  if (request == NULL || request->ready_at_us > now_us()) {
+    pthread_mutex_unlock(&requests_mutex);
+    return 1;
+  }
+  first_request = request->next;
+  if (first_request == NULL) {
+    last_request = NULL;
+  }
+  pthread_mutex_unlock(&requests_mutex);
+  *output_tensors = request->tensors;
+  free(request);
+  return 0;
+}
+
+int runtime_destruction(void) {
+  pthread_mutex_lock(&requests_mutex);
+  while (first_request != NULL) {
+    Request *request = first_request;
+    first_request = request->next;
+    free_tensors(request->tensors);
+    free(request);
+  }
+  last_request = NULL;
+  pthread_mutex_unlock(&requests_mutex);
+  return 0;
+}
+
+const char *runtime_error_message(void) { return ""; }
+const char *runtime_version(void) { return "1.0.0"; }
+const char *runtime_name(void) { return "mock"; }
@@ -0,0 +1,187 @@
+// Copyright (c) OAAX. All rights reserved.
+// Licensed under the Apache License, Version 2.0.
+
+// Description: Receive delay of the outputs of the mock runtime, i.e. the time
+// from an output being ready to the receiving thread getting it. It is
+// measured with the retry sleep of 100 ms the receiving thread used to wait
+// with, and with `poll_output`. Fails unless the poller at least halves the
+// p99 delay and keeps it under MAX_POLLER_P99_US.
+//
+// Usage: poll_latency_test <mock_runtime_library> [requests]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "runtime_utils.h"  // NOLINT[build/include]
+
+// C utilities
+#include "logger.h"     // NOLINT[build/include]
+#include "memory.h"     // NOLINT[build/include]
+#include "threading.h"  // NOLINT[build/include]
+#include "utils.h"      // NOLINT[build/include]
+
+// Time from a send to its output in the mock runtime
+#define COMPLETION_DELAY_US 2000
+// Maximum time to wait for one output with the poller
+#define MAX_WAIT_MS 1000
+// Largest p99 receive delay of the poller. It wakes up within 1 ms, the
+// rest is margin for loaded CI runners.
+#define MAX_POLLER_P99_US 5000
+
+Logger *logger = NULL;
+
+// Requests of the sending thread
+typedef struct {
+  RuntimeGroup *runtimes;
+  int count;
+  uint64_t *send_times_us;  // Written before each send
+} Sender;
+
+// Smallest input: a single float
+static tensors_struct *make_input_tensors(void) {
+  tensors_struct *tensors = (tensors_struct *)malloc(sizeof(tensors_struct));
+  tensors->num_tensors = 1;
+  tensors->names = (char **)malloc(sizeof(char *));
+  tensors->names[0] = strdup("input");
+  tensors->data_types = (tensor_data_type *)malloc(sizeof(tensor_data_type));
+  tensors->data_types[0] = DATA_TYPE_FLOAT;
+  tensors->ranks = (size_t *)malloc(sizeof(size_t));
+  tensors->ranks[0] = 1;
+  tensors->shapes = (size_t **)malloc(sizeof(size_t *));
+  tensors->shapes[0] = (size_t *)malloc(sizeof(size_t));
+  tensors->shapes[0][0] = 1;
+  tensors->data = (void **)malloc(sizeof(void *));
+  tensors->data[0] = calloc(1, sizeof(float));
+  return tensors;
+}
+
+// Send the requests 1 to 20 ms apart, like frames of a camera
+static void *send_requests(void *arg) {
+  Sender *sender = (Sender *)arg;
+  unsigned int random = 42;
+  for (int i = 0; i < sender->count; i++) {
+    random = random * 1103515245u + 12345u;
+    sleep_ms(1 + (int)((random >> 16) % 20));
+    sender->send_times_us[i] = monotonic_time_us();
+    if (runtime_group_send_input(sender->runtimes, 0, make_input_tensors()) !=
+        0) {
+      log_error(logger, "Failed to send request %d.", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+static int compare_delays(const void *a, const void *b) {
+  const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Send `count` requests while this thread receives their outputs, with
+// `poller` or with the retry sleep when it is NULL, and write their receive
+// delays in microseconds to `delays`, sorted
+static void measure_receive_delays(RuntimeGroup *runtimes,
+                                   OutputPoller *poller, int count,
+                                   int64_t *delays) {
+  uint64_t *send_times_us = (uint64_t *)calloc(count, sizeof(uint64_t));
+  Sender sender = {runtimes, count, send_times_us};
+  ThreadHandle sender_thread;
+  if (send_times_us == NULL ||
+      thread_create(&sender_thread, send_requests, &sender) != 0) {
+    log_error(logger, "Failed to start sending.");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < count; i++) {
+    tensors_struct *output_tensors = NULL;
+    size_t instance = 0;
+    if (poller == NULL) {
+      while (runtime_group_receive_output(runtimes, &output_tensors,
+                                          &instance) != 0) {
+        sleep_ms(100);
+      }
+    } else if (poll_output(poller, &output_tensors, &instance, MAX_WAIT_MS) !=
+               0) {
+      log_error(logger, "No output for request %d.", i);
+      exit(EXIT_FAILURE);
+    }
+    // Outputs come back in send order
+    delays[i] = (int64_t)monotonic_time_us() -
+                (int64_t)(send_times_us[i] + COMPLETION_DELAY_US);
+    deep_free_tensors_struct(output_tensors);
+  }
+  thread_join(&sender_thread);
+  free(send_times_us);
+  qsort(delays, count, sizeof(int64_t), compare_delays);
+}
+
+static int64_t percentile(const int64_t *sorted, int count, int percent) {
+  return sorted[(count - 1) * percent / 100];
+}
+
+static void report(const char *name, const int64_t *delays, int count) {
+  printf("%-12s p50 %7lld us   p99 %7lld us   max %7lld us\n", name,
+         (long long)percentile(delays, count, 50),
+         (long long)percentile(delays, count, 99),
+         (long long)delays[count - 1]);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <mock_runtime_library> [requests]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const int count = argc > 2 ? atoi(argv[2]) : 200;
+  if (count < 1) {
+    fprintf(stderr, "The number of requests must be positive.\n");
+    return EXIT_FAILURE;
+  }
+  logger = create_logger("Poll latency test", "poll_latency_test.log",
+                         LOG_INFO, LOG_INFO);
+  RuntimeGroup *runtimes = initialize_runtime_group(argv[1], 1);
+  if (runtimes == NULL) {
+    log_error(logger, "Failed to load the mock runtime.");
+    return EXIT_FAILURE;
+  }
+  const char *keys[] = {"completion_delay_us"};
+  const int completion_delay_us = COMPLETION_DELAY_US;
+  const void *values[] = {&completion_delay_us};
+  if (runtimes->runtimes[0]->runtime_initialization_with_args(1, keys,
+                                                              values) != 0) {
+    log_error(logger, "Failed to initialize the mock runtime.");
+    destroy_runtime_group(runtimes);
+    return EXIT_FAILURE;
+  }
+  printf("%d requests, outputs ready %d us after their send\n", count,
+         COMPLETION_DELAY_US);
+
+  int64_t *sleep_delays = (int64_t *)malloc(count * sizeof(int64_t));
+  int64_t *poller_delays = (int64_t *)malloc(count * sizeof(int64_t));
+  if (sleep_delays == NULL || poller_delays == NULL) {
+    log_error(logger, "Failed to allocate the receive delays.");
+    return EXIT_FAILURE;
+  }
+  measure_receive_delays(runtimes, NULL, count, sleep_delays);
+  report("sleep 100 ms", sleep_delays, count);
+
+  OutputPoller poller;
+  init_output_poller(&poller, runtimes);
+  measure_receive_delays(runtimes, &poller, count, poller_delays);
+  report("poller", poller_delays, count);
+
+  const int64_t poller_p99 = percentile(poller_delays, count, 99);
+  int code = EXIT_SUCCESS;
+  if (2 * poller_p99 > percentile(sleep_delays, count, 99)) {
+    log_error(logger, "The poller does not cut the p99 receive delay.");
+    code = EXIT_FAILURE;
+  }
+  if (poller_p99 >= MAX_POLLER_P99_US) {
+    log_error(logger, "The p99 receive delay of the poller exceeds %d us.",
+              MAX_POLLER_P99_US);
+    code = EXIT_FAILURE;
+  }
+  free(sleep_delays);
+  free(poller_delays);
+  destroy_runtime_group(runtimes);
+  return code;
+}
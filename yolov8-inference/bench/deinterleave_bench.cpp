@@ -0,0 +1,158 @@
+// Microbenchmark of the HWC -> CHW deinterleave kernels of create_tensors.
+// Times the per-pixel loop the tensors used to be filled with against the
+// kernels dispatched for this CPU, for every input data type, and checks that
+// both write the same tensor.
+//
+// Usage: deinterleave_bench [width] [height] [iterations]
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+#include "simd_kernels.hpp"
+
+// Per-pixel loops, writing the BGR pixels to the RGB planes
+void loop_u8_to_f32(const uint8_t *src, size_t n, const float scale[3],
+                    const float bias[3], float *r, float *g, float *b) {
+  for (size_t w = 0; w < n; ++w, src += 3) {
+    r[w] = src[2] * scale[0] + bias[0];
+    g[w] = src[1] * scale[1] + bias[1];
+    b[w] = src[0] * scale[2] + bias[2];
+  }
+}
+
+void loop_u8_to_u8(const uint8_t *src, size_t n, uint8_t *r, uint8_t *g,
+                   uint8_t *b) {
+  for (size_t w = 0; w < n; ++w, src += 3) {
+    r[w] = src[2];
+    g[w] = src[1];
+    b[w] = src[0];
+  }
+}
+
+void loop_u8_to_i8(const uint8_t *src, size_t n, int8_t *r, int8_t *g,
+                   int8_t *b) {
+  for (size_t w = 0; w < n; ++w, src += 3) {
+    r[w] = static_cast<int8_t>(min<uint8_t>(src[2], 127));
+    g[w] = static_cast<int8_t>(min<uint8_t>(src[1], 127));
+    b[w] = static_cast<int8_t>(min<uint8_t>(src[0], 127));
+  }
+}
+
+// Best time of `iterations` runs of `fill`, which writes a whole tensor, in
+// microseconds
+template <typename Fill>
+double best_time_us(int iterations, Fill fill) {
+  double best = INFINITY;
+  for (int i = 0; i < iterations; ++i) {
+    const auto start = chrono::steady_clock::now();
+    fill();
+    const chrono::duration<double, micro> elapsed =
+        chrono::steady_clock::now() - start;
+    best = min(best, elapsed.count());
+  }
+  return best;
+}
+
+// Time the loop and the kernel filling a planar tensor of type T from
+// `image`, row by row, and compare their tensors.
+// Returns false if they differ.
+template <typename T, typename Loop, typename Kernel>
+bool run(const char *type, const vector<uint8_t> &image, int width,
+         int height, int iterations, Loop loop_row, Kernel kernel_row) {
+  const size_t plane_size = static_cast<size_t>(width) * height;
+  vector<T> expected(3 * plane_size), actual(3 * plane_size);
+  const auto fill = [&](vector<T> &tensor, auto row_writer) {
+    for (int h = 0; h < height; ++h) {
+      T *r = tensor.data() + static_cast<size_t>(h) * width;
+      row_writer(image.data() + static_cast<size_t>(h) * width * 3, width, r,
+                 r + plane_size, r + 2 * plane_size);
+    }
+  };
+  const double loop_us =
+      best_time_us(iterations, [&] { fill(expected, loop_row); });
+  const double kernel_us =
+      best_time_us(iterations, [&] { fill(actual, kernel_row); });
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < expected.size(); ++i) {
+    // The vector kernels may fuse the multiply and add of float outputs
+    if constexpr (is_same_v<T, float>) {
+      mismatches += fabs(expected[i] - actual[i]) >
+                    1e-5f * max(1.0f, fabs(expected[i]));
+    } else {
+      mismatches += expected[i] != actual[i];
+    }
+  }
+  printf("%-8s loop %9.1f us   %-6s %9.1f us   x%.2f   %s\n", type, loop_us,
+         deinterleave_kernels().name, kernel_us, loop_us / kernel_us,
+         mismatches == 0 ? "match" : "MISMATCH");
+  if (mismatches != 0) {
+    fprintf(stderr, "%s: %zu of %zu values differ\n", type, mismatches,
+            expected.size());
+  }
+  return mismatches == 0;
+}
+
+int main(int argc, char **argv) {
+  const int width = argc > 1 ? atoi(argv[1]) : 640;
+  const int height = argc > 2 ? atoi(argv[2]) : 640;
+  const int iterations = argc > 3 ? atoi(argv[3]) : 200;
+  if (width <= 0 || height <= 0 || iterations <= 0) {
+    fprintf(stderr, "Usage: %s [width] [height] [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  printf("%dx%d BGR image, best of %d runs\n", width, height, iterations);
+
+  // Random pixels, with odd widths leaving a tail to the vector kernels
+  vector<uint8_t> image(static_cast<size_t>(width) * height * 3);
+  mt19937 random(42);
+  for (uint8_t &value : image) {
+    value = static_cast<uint8_t>(random());
+  }
+  // ImageNet mean and std, on the 0-255 scale
+  const float mean[3] = {123.675f, 116.28f, 103.53f};
+  const float stddev[3] = {58.395f, 57.12f, 57.375f};
+  float scale[3], bias[3];
+  for (int c = 0; c < 3; ++c) {
+    scale[c] = 1.0f / stddev[c];
+    bias[c] = -mean[c] * scale[c];
+  }
+  // Kernels map source channel k to plane k, as normalize_into_tensor does
+  const float scale_bgr[3] = {scale[2], scale[1], scale[0]};
+  const float bias_bgr[3] = {bias[2], bias[1], bias[0]};
+  const DeinterleaveKernels &kernels = deinterleave_kernels();
+
+  bool match = run<float>(
+      "float32", image, width, height, iterations,
+      [&](const uint8_t *src, int n, float *r, float *g, float *b) {
+        loop_u8_to_f32(src, n, scale, bias, r, g, b);
+      },
+      [&](const uint8_t *src, int n, float *r, float *g, float *b) {
+        kernels.u8_to_f32(src, n, scale_bgr, bias_bgr, b, g, r);
+      });
+  match &= run<uint8_t>(
+      "uint8", image, width, height, iterations,
+      [](const uint8_t *src, int n, uint8_t *r, uint8_t *g, uint8_t *b) {
+        loop_u8_to_u8(src, n, r, g, b);
+      },
+      [&](const uint8_t *src, int n, uint8_t *r, uint8_t *g, uint8_t *b) {
+        kernels.u8_to_u8(src, n, b, g, r);
+      });
+  match &= run<int8_t>(
+      "int8", image, width, height, iterations,
+      [](const uint8_t *src, int n, int8_t *r, int8_t *g, int8_t *b) {
+        loop_u8_to_i8(src, n, r, g, b);
+      },
+      [&](const uint8_t *src, int n, int8_t *r, int8_t *g, int8_t *b) {
+        kernels.u8_to_i8(src, n, b, g, r);
+      });
+  return match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -14,27 +14,52 @@
 
 using namespace std;
 
+#include "affinity.hpp"
 #include "cli.hpp"
 #include "config.hpp"
+#include "inflight_window.hpp"
 #include "logger.hpp"
 #include "preprocess.hpp"
+#include "requests.hpp"
 #include "runtime.hpp"
+#include "runtime_group.hpp"
+#include "runtime_poller.hpp"
+#include "simd_kernels.hpp"
 #include "tensors.hpp"
+#include "tensors_memory.hpp"
+
+// Pipeline, built on the headers above
+#include "async_runtime.hpp"
+#include "batching.hpp"
+#include "postprocess.hpp"
+#include "nms.hpp"
 #include "threads.hpp"
+#include "stages.hpp"
+#include "sink.hpp"
 
 int main(int argc, char **argv) {
   string library_path, model_path, input_path, log_file, config_path;
-  int log_level;
+  int log_level, num_instances;
   // Parse command line arguments
   int response =
       parse_command_line(argc, argv, library_path, model_path, input_path,
-                         config_path, log_file, log_level);
+                         config_path, log_file, log_level, num_instances);
   if (response != 0) {
     cerr << "Error parsing command line arguments.\n";
     return response;
   }
+  // Load the configuration file, and plan which cores the threads run on
+  // before the logger starts its own
+  json config = load_config(config_path);
+  StageConfig stage_config = parse_stage_config(config);
+  AffinityPlan affinity = plan_affinity(
+      parse_affinity_config(config), read_cpu_topology(),
+      stage_config.decode_workers, stage_config.preprocess_workers,
+      stage_config.postprocess_workers, num_instances);
   // Initialize the logger
-  auto logger = initialize_logger(log_file, log_level, log_level);
+  auto logger = initialize_logger(
+      log_file, log_level, log_level, "OAAX",
+      [cpus = affinity.logger] { pin_current_thread(cpus); });
 
   // Log the initialization
   logger.info(
@@ -46,36 +71,58 @@ int main(int argc, char **argv) {
   logger.info("Configuration Path: {}", config_path);
   logger.info("Log File: {}", log_file);
   logger.info("Log Level: {}", log_level);
+  logger.info("Runtime Instances: {}", num_instances);
 
-  // Load the runtime library
-  Runtime *runtime = load_runtime_library(library_path);
+  // Load the runtime library, once per instance
+  RuntimeGroup *runtimes = new RuntimeGroup(library_path, num_instances);
   // Log the runtime name and version
-  logger.info("Runtime Name: {}", runtime->runtime_name());
-  logger.info("Runtime Version: {}", runtime->runtime_version());
-
-  // Initialize the runtime and load the model
-  int exit_code;
-  const char *args[] = {"log_level"};
-  const void *args_values[] = {"2"};  // Set log level to info
-  exit_code = runtime->runtime_initialization_with_args(1, args, args_values);
-
-  if (exit_code != 0) {
-    logger.error("Runtime initialization failed: {}",
-                 runtime->runtime_error_message());
-    destroy_runtime(runtime);
-    return EXIT_FAILURE;
+  logger.info("Runtime Name: {}", runtimes->instance(0)->runtime_name());
+  logger.info("Runtime Version: {}", runtimes->instance(0)->runtime_version());
+
+  log_affinity_plan(affinity);
+  const CpuSet main_cpus = current_thread_cpus();
+  // Initialize every runtime instance and load the model into it
+  for (size_t i = 0; i < runtimes->size(); ++i) {
+    Runtime *runtime = runtimes->instance(i);
+    int exit_code;
+    if (affinity.enabled()) {
+      // The threads the runtime starts inherit the cores of this thread
+      pin_current_thread(affinity.runtimes[i]);
+      // Model duplicates and their threads to fill these cores
+      const char *args[] = {"log_level", "n_duplicates",
+                            "n_threads_per_duplicate"};
+      const void *args_values[] = {"2", &affinity.n_duplicates,
+                                   &affinity.n_threads_per_duplicate};
+      exit_code =
+          runtime->runtime_initialization_with_args(3, args, args_values);
+    } else {
+      const char *args[] = {"log_level"};
+      const void *args_values[] = {"2"};  // Set log level to info
+      exit_code =
+          runtime->runtime_initialization_with_args(1, args, args_values);
+    }
+
+    if (exit_code != 0) {
+      logger.error("Runtime initialization failed: {}",
+                   runtime->runtime_error_message());
+      delete runtimes;
+      return EXIT_FAILURE;
+    }
+    logger.info("Runtime {} initialized successfully.", i);
+    exit_code = runtime->runtime_model_loading(model_path.c_str());
+    if (exit_code != 0) {
+      logger.error("Model loading failed: {}",
+                   runtime->runtime_error_message());
+      delete runtimes;
+      return EXIT_FAILURE;
+    }
+    logger.info("Model loaded successfully into runtime {}: {}", i,
+                model_path);
   }
-  logger.info("Runtime initialized successfully.");
-  exit_code = runtime->runtime_model_loading(model_path.c_str());
-  if (exit_code != 0) {
-    logger.error("Model loading failed: {}", runtime->runtime_error_message());
-    destroy_runtime(runtime);
-    return EXIT_FAILURE;
+  if (affinity.enabled()) {
+    pin_current_thread(main_cpus);
   }
-  logger.info("Model loaded successfully: {}", model_path);
 
-  // Load the configuration file
-  json config = load_config(config_path);
   // Log the configuration parameters
   logger.info("Configuration: {}", config.dump(4));
 
@@ -83,63 +130,131 @@ int main(int argc, char **argv) {
   if (config["model"]["mean"].size() != 3 ||
       config["model"]["std"].size() != 3) {
     logger.error("Mean and std must be 3-element vectors.");
-    destroy_runtime(runtime);
+    delete runtimes;
     return EXIT_FAILURE;
   }
 
-  // Preprocess the input image
-  cv::Mat image =
-      preprocess_image(input_path, config["model"]["input_width"].get<int>(),
-                       config["model"]["input_height"].get<int>(),
-                       SQUASH,  // Use SQUASH as the desired method
-                       cv::Scalar(config["model"]["mean"][0].get<float>(),
-                                  config["model"]["mean"][1].get<float>(),
-                                  config["model"]["mean"][2].get<float>()),
-                       cv::Scalar(config["model"]["std"][0].get<float>(),
-                                  config["model"]["std"][1].get<float>(),
-                                  config["model"]["std"][2].get<float>()));
-  // Create the input tensors
+  const int input_width = config["model"]["input_width"].get<int>();
+  const int input_height = config["model"]["input_height"].get<int>();
+  cv::Scalar mean(config["model"]["mean"][0].get<float>(),
+                  config["model"]["mean"][1].get<float>(),
+                  config["model"]["mean"][2].get<float>());
+  cv::Scalar stddev(config["model"]["std"][0].get<float>(),
+                    config["model"]["std"][1].get<float>(),
+                    config["model"]["std"][2].get<float>());
   string input_name = config["model"]["input_name"].get<string>();
-  tensors_struct *tensors;
+  const bool nchw = config["model"]["nchw"].get<int>();
+  string input_dtype = "float32";
   if (config["model"].contains("input_dtype")) {
-    tensors =
-        create_tensors(image, input_name, config["model"]["nchw"].get<int>(),
-                       config["model"]["input_dtype"].get<string>());
-  } else {
-    tensors =
-        create_tensors(image, input_name, config["model"]["nchw"].get<int>());
+    input_dtype = config["model"]["input_dtype"].get<string>();
   }
-  image.release();
-
-  if (!tensors) {
-    logger.error("Failed to create input tensors.");
-    destroy_runtime(runtime);
-    return EXIT_FAILURE;
+  // Optional quantization parameters of integer inputs
+  InputQuantization quantization;
+  if (config["model"].contains("input_scale")) {
+    quantization.scale = config["model"]["input_scale"].get<float>();
+  }
+  if (config["model"].contains("input_zero_point")) {
+    quantization.zero_point = config["model"]["input_zero_point"].get<int>();
   }
-  print_tensors_metadata(tensors);
 
-  spdlog::info("Starting input sending and output receiving threads...");
-  // Start the input sending thread
-  thread input_thread(send_input_tensors_routine, runtime, tensors);
-  // Start the output receiving thread
-  thread output_thread(receive_output_tensors_routine, runtime);
-  // Wait for the threads to finish
-  spdlog::info("Waiting for threads to finish...");
-  input_thread.join();
-  output_thread.join();
+  PipelineOptions options;
+  // Optional dynamic batching, for runtimes and models with a dynamic batch
+  // dimension
+  options.batching = parse_batching_config(config);
+  logger.info("Batching: up to {} frames, {} us delay",
+              options.batching.max_batch, options.batching.max_delay.count());
+  // Optional limits of the requests in flight, possibly tuned at runtime
+  options.window = parse_window_config(config);
+  logger.info("In-flight window: {} per runtime, {}", options.window.initial,
+              options.window.adaptive ? "adaptive" : "fixed");
+  // Optional worker counts of the stages
+  logger.info(
+      "Pipeline: {} frames, {} decode, {} preprocess and {} postprocess "
+      "worker(s)",
+      stage_config.frames, stage_config.decode_workers,
+      stage_config.preprocess_workers, stage_config.postprocess_workers);
+  // Frames that miss their deadline are dropped
+  options.deadline = stage_config.deadline;
+  // Optional decoding parameters of the detections
+  PostprocessConfig postprocess_config = parse_postprocess_config(config);
+  logger.info(
+      "Postprocessing: score threshold {}, {} score kernels, {} box kernel",
+      postprocess_config.score_threshold, score_kernels().name,
+      box_kernels().name);
+  logger.info("Quantized outputs: scale {}, zero point {}",
+              postprocess_config.output_scale,
+              postprocess_config.output_zero_point);
+  // Optional non-maximum suppression parameters
+  NmsConfig nms_config = parse_nms_config(config);
+  logger.info("NMS: IoU threshold {}, top {} candidates, {}",
+              nms_config.iou_threshold, nms_config.top_k,
+              nms_config.class_agnostic ? "class-agnostic" : "per class");
+  options.affinity = affinity;
+  options.n_duplicates = affinity.n_duplicates;
+  // Optional file the detections are appended to
+  SinkConfig sink_config = parse_sink_config(config);
+  unique_ptr<ResultSink> results;
+  if (!sink_config.path.empty()) {
+    results = make_unique<ResultSink>(sink_config);
+    logger.info("Results: {} records appended to {}, {} KiB buffer",
+                sink_config.format, sink_config.path,
+                sink_config.buffer_bytes / 1024);
+  }
 
-  spdlog::info("Threads finished successfully.");
+  InferencePipeline inference(runtimes, options);
+  StagedPipeline pipeline(
+      &inference, stage_config,
+      // Decode the input image and resize it to the model resolution
+      [&](size_t, cv::Mat &image, ImageTransform &transform) {
+        image = preprocess_image(input_path, input_width, input_height,
+                                 SQUASH,  // Use SQUASH as the desired method
+                                 transform);
+        return !image.empty();
+      },
+      // Normalize the image and lay it out into the input tensors
+      [&](const cv::Mat &image) {
+        return create_tensors(image, input_name, mean, stddev, nchw,
+                              input_dtype, quantization);
+      },
+      // Decode the detections of the YOLOv8 head, suppress the overlapping
+      // ones and map the others back to the input image
+      [&](FrameResult &result) {
+        // One engine per postprocessing worker, which reuses its buffers
+        thread_local NmsEngine nms(nms_config);
+        if (!decode_yolov8(result.output, postprocess_config,
+                           result.detections)) {
+          spdlog::warn("No YOLOv8 detection head in the outputs of frame {}.",
+                       result.frame);
+          return;
+        }
+        nms.run(result.detections);
+        map_to_source(result.output.transform(), result.detections);
+      },
+      [&results](const FrameResult &result) {
+        spdlog::debug("Frame {} of request {}: {} detection(s)", result.frame,
+                      result.request_id, result.detections.size());
+        if (results) {
+          results->write(result);
+        }
+      });
+  spdlog::info("Starting the pipeline stages...");
+  const bool succeeded = pipeline.run();
+  if (succeeded) {
+    spdlog::info("Pipeline finished successfully.");
+  } else {
+    spdlog::error("Pipeline finished without processing all frames.");
+  }
+  if (results) {
+    results->close();
+  }
 
   // Clean up resources
   logger.info("Terminating OAAX inference engine.");
-  // Free the input tensors
-  deep_free_tensors_struct(tensors);
-
-  // Destroy the runtime
-  destroy_runtime(runtime);
+  // Destroy the runtime instances
+  delete runtimes;
 
   // Destroy the logger
   destroy_logger();
 
-  return 0;
+  return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Logical CPUs, as numbered by the kernel
+typedef vector<int> CpuSet;
+
+// Placement of the threads, from the optional "affinity" object of the JSON
+// config. Pinned threads neither migrate between cores nor compete with the
+// runtime or with each other for a core, which shows in the tail latency.
+struct AffinityConfig {
+  bool enabled = false;
+  // Physical cores for the threads of the pipeline, 0 to pick a number
+  int pipeline_cores = 0;
+  // Threads of every model duplicate of a runtime instance, 0 for a single
+  // duplicate using all the cores of its instance. Several duplicates may
+  // complete requests out of order, see PipelineOptions::n_duplicates
+  int threads_per_duplicate = 0;
+};
+
+AffinityConfig parse_affinity_config(const nlohmann::json &config) {
+  AffinityConfig affinity;
+  if (!config.contains("affinity")) {
+    return affinity;
+  }
+  const nlohmann::json &section = config["affinity"];
+  if (section.contains("enabled")) {
+    affinity.enabled = section["enabled"].get<bool>();
+  }
+  if (section.contains("pipeline_cores")) {
+    affinity.pipeline_cores = section["pipeline_cores"].get<int>();
+  }
+  if (section.contains("threads_per_duplicate")) {
+    affinity.threads_per_duplicate =
+        section["threads_per_duplicate"].get<int>();
+  }
+  if (affinity.pipeline_cores < 0 || affinity.threads_per_duplicate < 0) {
+    spdlog::error(
+        "The affinity requires pipeline_cores >= 0 and "
+        "threads_per_duplicate >= 0.");
+    exit(EXIT_FAILURE);
+  }
+  return affinity;
+}
+
+// Logical CPUs sharing one physical core, i.e. its hyper-threads
+struct PhysicalCore {
+  int package;
+  int id;
+  CpuSet cpus;
+};
+
+// Parse a CPU list of the kernel, e.g. "0-3,8,10-11"
+CpuSet parse_cpu_list(const string &list) {
+  CpuSet cpus;
+  stringstream stream(list);
+  string range;
+  while (getline(stream, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    const size_t dash = range.find('-');
+    const int first = stoi(range.substr(0, dash));
+    const int last =
+        dash == string::npos ? first : stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// Format a CPU list the way the kernel does
+string format_cpu_list(const CpuSet &cpus) {
+  string list;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t last = i;
+    while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1) {
+      last++;
+    }
+    if (!list.empty()) {
+      list += ",";
+    }
+    list += to_string(cpus[i]);
+    if (last > i) {
+      list += "-" + to_string(cpus[last]);
+    }
+    i = last + 1;
+  }
+  return list.empty() ? "none" : list;
+}
+
+bool read_sys_int(const string &path, int &value) {
+  ifstream file(path);
+  return static_cast<bool>(file >> value);
+}
+
+// Physical cores of the CPUs this process may run on, ordered by package and
+// core ID, from /sys/devices/system/cpu. Without it, every CPU counts as a
+// core of its own.
+vector<PhysicalCore> read_cpu_topology() {
+  const string root = "/sys/devices/system/cpu/";
+  CpuSet online;
+  ifstream file(root + "online");
+  string list;
+  if (getline(file, list)) {
+    online = parse_cpu_list(list);
+  }
+  if (online.empty()) {
+    for (unsigned cpu = 0; cpu < thread::hardware_concurrency(); ++cpu) {
+      online.push_back(static_cast<int>(cpu));
+    }
+  }
+#if defined(__linux__)
+  // Leave out the CPUs the process is not allowed on, e.g. by taskset or
+  // cgroups
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    online.erase(remove_if(online.begin(), online.end(),
+                           [&allowed](int cpu) {
+                             return cpu >= CPU_SETSIZE ||
+                                    !CPU_ISSET(cpu, &allowed);
+                           }),
+                 online.end());
+  }
+#endif
+  map<pair<int, int>, CpuSet> cpus_by_core;
+  for (int cpu : online) {
+    const string topology = root + "cpu" + to_string(cpu) + "/topology/";
+    int package = 0;
+    int core = 0;
+    if (!read_sys_int(topology + "physical_package_id", package) ||
+        !read_sys_int(topology + "core_id", core)) {
+      package = -1;
+      core = cpu;
+    }
+    cpus_by_core[{package, core}].push_back(cpu);
+  }
+  vector<PhysicalCore> cores;
+  for (const auto &entry : cpus_by_core) {
+    cores.push_back({entry.first.first, entry.first.second, entry.second});
+  }
+  return cores;
+}
+
+// Cores every thread runs on. Empty sets leave their threads unpinned.
+struct AffinityPlan {
+  CpuSet receiver;
+  CpuSet sender;  // And the thread feeding the batches
+  CpuSet logger;
+  vector<CpuSet> preprocess;  // Per worker
+  vector<CpuSet> decode;
+  vector<CpuSet> postprocess;
+  CpuSet sink;
+  vector<CpuSet> runtimes;  // Per runtime instance
+  // Runtime arguments that fit the cores of an instance
+  int n_duplicates = 1;
+  int n_threads_per_duplicate = 1;
+
+  bool enabled() const { return !runtimes.empty(); }
+};
+
+// Give every thread of the pipeline a physical core of its own and split the
+// remaining cores between the runtime instances. With fewer cores than
+// threads, the receiver, sender and logger keep one each for as long as they
+// can, and the other threads share the rest.
+// The pipeline takes the last cores, away from CPU 0 that usually serves
+// the interrupts.
+AffinityPlan plan_affinity(const AffinityConfig &config,
+                           const vector<PhysicalCore> &cores,
+                           int decode_workers, int preprocess_workers,
+                           int postprocess_workers, size_t num_instances) {
+  AffinityPlan plan;
+  if (!config.enabled) {
+    return plan;
+  }
+  const int total = static_cast<int>(cores.size());
+  const int instances = static_cast<int>(num_instances);
+  if (total < instances + 1) {
+    spdlog::warn(
+        "Threads left unpinned: {} core(s) for {} runtime instance(s) and "
+        "the pipeline.",
+        total, instances);
+    return plan;
+  }
+  plan.preprocess.resize(preprocess_workers);
+  plan.decode.resize(decode_workers);
+  plan.postprocess.resize(postprocess_workers);
+  vector<CpuSet *> threads = {&plan.receiver, &plan.sender, &plan.logger};
+  const int kDedicatedThreads = 3;
+  for (CpuSet &cpus : plan.preprocess) {
+    threads.push_back(&cpus);
+  }
+  for (CpuSet &cpus : plan.decode) {
+    threads.push_back(&cpus);
+  }
+  for (CpuSet &cpus : plan.postprocess) {
+    threads.push_back(&cpus);
+  }
+  threads.push_back(&plan.sink);
+
+  // By default at most half of the cores, the runtime does the heavy work
+  int pipeline_cores = config.pipeline_cores;
+  if (pipeline_cores == 0) {
+    pipeline_cores =
+        min(static_cast<int>(threads.size()), max(1, total / 2));
+  }
+  pipeline_cores = min(pipeline_cores, total - instances);
+  const int shared_from = min(kDedicatedThreads, pipeline_cores - 1);
+  for (int i = 0; i < static_cast<int>(threads.size()); ++i) {
+    int core = i;
+    if (core >= pipeline_cores) {
+      core = shared_from + (i - shared_from) % (pipeline_cores - shared_from);
+    }
+    *threads[i] = cores[total - 1 - core].cpus;
+  }
+
+  // One compute thread per physical core of the instance
+  const int runtime_cores = total - pipeline_cores;
+  const int cores_per_instance = runtime_cores / instances;
+  for (int i = 0; i < instances; ++i) {
+    CpuSet cpus;
+    for (int core = i * cores_per_instance;
+         core < (i + 1) * cores_per_instance; ++core) {
+      cpus.insert(cpus.end(), cores[core].cpus.begin(),
+                  cores[core].cpus.end());
+    }
+    sort(cpus.begin(), cpus.end());
+    plan.runtimes.push_back(cpus);
+  }
+  plan.n_threads_per_duplicate = cores_per_instance;
+  if (config.threads_per_duplicate > 0) {
+    plan.n_threads_per_duplicate =
+        min(config.threads_per_duplicate, cores_per_instance);
+  }
+  plan.n_duplicates = cores_per_instance / plan.n_threads_per_duplicate;
+  return plan;
+}
+
+void log_affinity_plan(const AffinityPlan &plan) {
+  if (!plan.enabled()) {
+    spdlog::info("Affinity: threads unpinned");
+    return;
+  }
+  spdlog::info("Affinity: receiver on CPUs {}, sender on {}, logger on {}",
+               format_cpu_list(plan.receiver), format_cpu_list(plan.sender),
+               format_cpu_list(plan.logger));
+  for (size_t i = 0; i < plan.preprocess.size(); ++i) {
+    spdlog::info("Affinity: preprocess worker {} on CPUs {}", i,
+                 format_cpu_list(plan.preprocess[i]));
+  }
+  for (size_t i = 0; i < plan.runtimes.size(); ++i) {
+    spdlog::info(
+        "Affinity: runtime {} on CPUs {}, {} duplicate(s) of {} thread(s)", i,
+        format_cpu_list(plan.runtimes[i]), plan.n_duplicates,
+        plan.n_threads_per_duplicate);
+  }
+}
+
+// Restrict the calling thread to `cpus`, does nothing for an empty set.
+// Threads it creates afterwards inherit them.
+// Returns false if the thread could not be pinned.
+bool pin_current_thread(const CpuSet &cpus) {
+  if (cpus.empty()) {
+    return true;
+  }
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (error != 0) {
+    spdlog::warn("Failed to pin a thread to CPUs {}: {}",
+                 format_cpu_list(cpus), strerror(error));
+    return false;
+  }
+  return true;
+#else
+  spdlog::warn("Pinning threads is only supported on Linux.");
+  return false;
+#endif
+}
+
+// CPUs the calling thread may run on, e.g. to undo a temporary pinning
+CpuSet current_thread_cpus() {
+  CpuSet cpus;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
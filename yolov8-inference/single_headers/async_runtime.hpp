@@ -0,0 +1,272 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Asynchronous inference over the send/receive interface of a runtime group.
+// `infer` returns a future, and `infer_async` an awaitable for coroutines,
+// so callers do not have to run their own sending and receiving threads.
+//
+// A single internal thread receives the outputs and completes the requests.
+// The OAAX interface carries no request ID, so each instance's outputs are
+// matched first-in first-out to the requests sent to it. That is exact for
+// runtimes that complete their requests in order, but not for a runtime
+// instance running several model duplicates (n_duplicates > 1): its outputs
+// may then complete the wrong requests.
+// Requests beyond `max_in_flight` wait in a queue and are sent as earlier ones
+// complete, so thousands of them can be pending on a few threads.
+// Outputs are freed with the allocator of their runtime instance, so they must
+// be released before the runtime group is destroyed.
+class AsyncRuntime {
+ public:
+  typedef shared_ptr<tensors_struct> Outputs;
+  // Called once, with either the outputs of a request or the error that
+  // failed it
+  typedef function<void(Outputs, exception_ptr)> Completion;
+
+  // `max_in_flight` 0 sends every request right away
+  explicit AsyncRuntime(RuntimeGroup *runtimes, int max_in_flight = 0)
+      : runtimes_(runtimes),
+        max_in_flight_(max_in_flight),
+        in_flight_(0),
+        pending_(runtimes->size()) {
+    receiver_ = thread(&AsyncRuntime::receive_routine, this);
+  }
+
+  // Fails the requests still pending, whose outputs are then dropped
+  ~AsyncRuntime() {
+    {
+      lock_guard<mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_.notify_all();
+    receiver_.join();
+    vector<Completion> failed;
+    for (deque<Completion> &queue : pending_) {
+      for (Completion &completion : queue) {
+        failed.push_back(move(completion));
+      }
+    }
+    for (Request &request : waiting_) {
+      deep_free_tensors_struct(request.inputs);
+      failed.push_back(move(request.completion));
+    }
+    exception_ptr error =
+        make_exception_ptr(runtime_error("The runtime was shut down."));
+    for (Completion &completion : failed) {
+      completion(nullptr, error);
+    }
+  }
+
+  AsyncRuntime(const AsyncRuntime &) = delete;
+  AsyncRuntime &operator=(const AsyncRuntime &) = delete;
+
+  // Run the inference of `inputs`, whose ownership is transferred, and call
+  // `completion` with its result. The completion of a request that was sent
+  // runs on the receiving thread, so it should be short.
+  void submit(tensors_struct *inputs, Completion completion) {
+    Request request{inputs, move(completion)};
+    exception_ptr error;
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (stopping_) {
+        error =
+            make_exception_ptr(runtime_error("The runtime was shut down."));
+      } else if (max_in_flight_ > 0 && in_flight_ >= max_in_flight_) {
+        waiting_.push_back(move(request));
+        return;
+      } else {
+        error = send_locked(request);
+      }
+    }
+    if (error) {
+      deep_free_tensors_struct(request.inputs);
+      request.completion(nullptr, error);
+    } else {
+      work_.notify_one();
+    }
+  }
+
+  // Run the inference of `inputs`, whose ownership is transferred
+  future<Outputs> infer(tensors_struct *inputs) {
+    shared_ptr<promise<Outputs>> result = make_shared<promise<Outputs>>();
+    future<Outputs> outputs = result->get_future();
+    submit(inputs, [result](Outputs outputs, exception_ptr error) {
+      if (error) {
+        result->set_exception(error);
+      } else {
+        result->set_value(move(outputs));
+      }
+    });
+    return outputs;
+  }
+
+  // `co_await runtime.infer_async(inputs)` suspends the coroutine until the
+  // outputs are received, and resumes it on the receiving thread. Errors are
+  // thrown from the co_await.
+  class Awaitable {
+   public:
+    Awaitable(AsyncRuntime *runtime, tensors_struct *inputs)
+        : runtime_(runtime), inputs_(inputs) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(coroutine_handle<> handle) {
+      runtime_->submit(inputs_,
+                       [this, handle](Outputs outputs, exception_ptr error) {
+                         outputs_ = move(outputs);
+                         error_ = error;
+                         handle.resume();
+                       });
+    }
+
+    Outputs await_resume() {
+      if (error_) {
+        rethrow_exception(error_);
+      }
+      return move(outputs_);
+    }
+
+   private:
+    AsyncRuntime *runtime_;
+    tensors_struct *inputs_;
+    Outputs outputs_;
+    exception_ptr error_;
+  };
+
+  Awaitable infer_async(tensors_struct *inputs) {
+    return Awaitable(this, inputs);
+  }
+
+  // Requests sent and not completed yet
+  int in_flight() {
+    lock_guard<mutex> lock(mutex_);
+    return in_flight_;
+  }
+
+  // Requests waiting for room in the window
+  size_t waiting() {
+    lock_guard<mutex> lock(mutex_);
+    return waiting_.size();
+  }
+
+ private:
+  struct Request {
+    tensors_struct *inputs;
+    Completion completion;
+  };
+
+  // Send a request to the least loaded instance, and queue its completion
+  // there, unless it fails. Must be called with the lock held, so that the
+  // completions of an instance are queued in send order.
+  exception_ptr send_locked(Request &request) {
+    const size_t instance = runtimes_->least_loaded();
+    Runtime *runtime = runtimes_->instance(instance);
+    // An isolated instance frees its inputs with its own allocator, so it is
+    // sent a copy made with that allocator
+    tensors_struct *inputs = request.inputs;
+    if (runtime->isolated) {
+      inputs =
+          copy_tensors(request.inputs, runtime->allocate, runtime->deallocate);
+      if (!inputs) {
+        return make_exception_ptr(
+            runtime_error("Failed to copy the input tensors."));
+      }
+    }
+    // Queued before sending, so that its output always finds it
+    pending_[instance].push_back(move(request.completion));
+    if (runtimes_->send_input(instance, inputs) != 0) {
+      request.completion = move(pending_[instance].back());
+      pending_[instance].pop_back();
+      if (inputs != request.inputs) {
+        free_tensors(inputs, runtime->deallocate);
+      }
+      return make_exception_ptr(
+          runtime_error(string("Failed to send input tensors: ") +
+                        runtime->runtime_error_message()));
+    }
+    if (inputs != request.inputs) {
+      deep_free_tensors_struct(request.inputs);
+    }
+    in_flight_++;
+    return nullptr;
+  }
+
+  void receive_routine() {
+    OutputPoller poller(runtimes_);
+    while (true) {
+      {
+        // Sleep while there is nothing to receive
+        unique_lock<mutex> lock(mutex_);
+        work_.wait(lock, [this] { return stopping_ || in_flight_ > 0; });
+        if (stopping_) {
+          return;
+        }
+      }
+      size_t instance = 0;
+      tensors_struct *output_tensors =
+          poller.receive(chrono::milliseconds(100), instance, &stopping_);
+      if (!output_tensors) {
+        continue;
+      }
+      Completion completion;
+      vector<Request> failed;
+      vector<exception_ptr> errors;
+      {
+        lock_guard<mutex> lock(mutex_);
+        deque<Completion> &queue = pending_[instance];
+        if (!queue.empty()) {
+          completion = move(queue.front());
+          queue.pop_front();
+          in_flight_--;
+        }
+        // Send the requests that waited for this one to complete
+        while (!waiting_.empty() && in_flight_ < max_in_flight_) {
+          Request request = move(waiting_.front());
+          waiting_.pop_front();
+          exception_ptr error = send_locked(request);
+          if (error) {
+            failed.push_back(move(request));
+            errors.push_back(error);
+          }
+        }
+      }
+      // Outputs are allocated in the heap of their instance
+      void (*deallocate)(void *) = runtimes_->instance(instance)->deallocate;
+      if (completion) {
+        completion(Outputs(output_tensors,
+                           [deallocate](tensors_struct *tensors) {
+                             free_tensors(tensors, deallocate);
+                           }),
+                   nullptr);
+      } else {
+        spdlog::warn("Received output tensors without a request.");
+        free_tensors(output_tensors, deallocate);
+      }
+      for (size_t i = 0; i < failed.size(); ++i) {
+        deep_free_tensors_struct(failed[i].inputs);
+        failed[i].completion(nullptr, errors[i]);
+      }
+    }
+  }
+
+  RuntimeGroup *runtimes_;
+  const int max_in_flight_;
+  mutex mutex_;
+  condition_variable work_;
+  atomic<bool> stopping_{false};
+  int in_flight_;
+  // Completions of the requests in flight, per instance, in send order
+  vector<deque<Completion>> pending_;
+  deque<Request> waiting_;
+  thread receiver_;
+};
@@ -0,0 +1,231 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Dynamic batching parameters, from the optional "batching" object of the
+// JSON config. With max_batch = 1 every frame is sent on its own.
+struct BatchingConfig {
+  int max_batch;                   // Maximum number of frames per batch
+  chrono::microseconds max_delay;  // Maximum wait for a batch to fill up
+  BatchingConfig(int batch = 1,
+                 chrono::microseconds delay = chrono::microseconds(0))
+      : max_batch(batch), max_delay(delay) {}
+};
+
+BatchingConfig parse_batching_config(const nlohmann::json &config) {
+  BatchingConfig batching;
+  if (!config.contains("batching")) {
+    return batching;
+  }
+  const nlohmann::json &section = config["batching"];
+  if (section.contains("max_batch")) {
+    batching.max_batch = section["max_batch"].get<int>();
+  }
+  if (section.contains("max_delay_us")) {
+    batching.max_delay =
+        chrono::microseconds(section["max_delay_us"].get<int64_t>());
+  }
+  if (batching.max_batch < 1 || batching.max_delay.count() < 0) {
+    spdlog::error("Batching requires max_batch >= 1 and max_delay_us >= 0.");
+    exit(EXIT_FAILURE);
+  }
+  return batching;
+}
+
+// A frame of batch size 1, with the time it was captured
+struct TimedFrame {
+  tensors_struct *tensors;
+  chrono::steady_clock::time_point captured_at;
+  // Geometry of its preprocessing, handed over to its output
+  ImageTransform transform = ImageTransform();
+};
+
+// Collects single frames until `max_batch` are queued, or the oldest one has
+// waited `max_delay`, whichever comes first.
+// At most two batches are queued, so that the frames are not produced faster
+// than they are sent.
+class BatchQueue {
+ public:
+  explicit BatchQueue(const BatchingConfig &config)
+      : config_(config), capacity_(2 * config.max_batch) {}
+
+  // Queue a frame of batch size 1, whose ownership is transferred. Waits for
+  // room in the queue.
+  void submit(const TimedFrame &frame) {
+    {
+      unique_lock<mutex> lock(mutex_);
+      room_.wait(lock, [this] { return frames_.size() < capacity_; });
+      frames_.push_back(Frame{frame, chrono::steady_clock::now()});
+    }
+    changed_.notify_one();
+  }
+
+  // No more frames will be submitted
+  void close() {
+    {
+      lock_guard<mutex> lock(mutex_);
+      closed_ = true;
+    }
+    changed_.notify_all();
+  }
+
+  // Wait for the next batch and move its frames into `batch`.
+  // Returns false once the queue is closed and drained.
+  bool next_batch(vector<TimedFrame> &batch) {
+    batch.clear();
+    unique_lock<mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return !frames_.empty() || closed_; });
+    if (frames_.empty()) {
+      return false;
+    }
+    // The deadline is set by the oldest frame of the batch
+    const auto deadline = frames_.front().queued_at + config_.max_delay;
+    changed_.wait_until(lock, deadline, [this] {
+      return frames_.size() >= static_cast<size_t>(config_.max_batch) ||
+             closed_;
+    });
+    while (!frames_.empty() &&
+           batch.size() < static_cast<size_t>(config_.max_batch)) {
+      batch.push_back(frames_.front().frame);
+      frames_.pop_front();
+    }
+    room_.notify_all();
+    return true;
+  }
+
+ private:
+  struct Frame {
+    TimedFrame frame;
+    chrono::steady_clock::time_point queued_at;
+  };
+
+  const BatchingConfig config_;
+  const size_t capacity_;
+  mutex mutex_;
+  condition_variable changed_;
+  condition_variable room_;
+  deque<Frame> frames_;
+  bool closed_ = false;
+};
+
+// Pack frames of batch size 1 with identical layouts into one tensors_struct
+// whose tensors are contiguous N x ... buffers, ready for `send_input`. The
+// batch is allocated with the allocator of the runtime instance it is sent
+// to, see Runtime::allocate.
+// The frames are left untouched. Returns nullptr on failure.
+tensors_struct *pack_batch(const vector<tensors_struct *> &frames,
+                           void *(*allocate)(size_t),
+                           void (*deallocate)(void *)) {
+  const tensors_struct *first = frames.front();
+  const size_t batch_size = frames.size();
+  const size_t num_tensors = first->num_tensors;
+  tensors_struct *batch = allocate_tensors(num_tensors, allocate, deallocate);
+  if (!batch) {
+    spdlog::error("Failed to allocate a batch of {} tensors.", num_tensors);
+    return nullptr;
+  }
+  for (size_t i = 0; i < num_tensors; ++i) {
+    const size_t frame_bytes = tensor_size_in_bytes(first, i);
+    const size_t name_size = strlen(first->names[i]) + 1;
+    batch->names[i] = (char *)allocate(name_size);
+    batch->data_types[i] = first->data_types[i];
+    batch->ranks[i] = first->ranks[i];
+    batch->shapes[i] = (size_t *)allocate(first->ranks[i] * sizeof(size_t));
+    batch->data[i] = allocate(frame_bytes * batch_size);
+    // Scalars have no batch dimension to stack the frames along
+    if (frame_bytes == 0 || first->ranks[i] == 0 || !batch->names[i] ||
+        !batch->shapes[i] || !batch->data[i]) {
+      spdlog::error("Failed to pack tensor {} into a batch.", first->names[i]);
+      free_tensors(batch, deallocate);
+      return nullptr;
+    }
+    memcpy(batch->names[i], first->names[i], name_size);
+    memcpy(batch->shapes[i], first->shapes[i],
+           first->ranks[i] * sizeof(size_t));
+    batch->shapes[i][0] = batch_size;
+    for (size_t n = 0; n < batch_size; ++n) {
+      memcpy(static_cast<uint8_t *>(batch->data[i]) + n * frame_bytes,
+             frames[n]->data[i], frame_bytes);
+    }
+  }
+  return batch;
+}
+
+// Result of one frame of a batch: a view into the batched output tensors,
+// which stay alive as long as any of their views does. Nothing is copied.
+// A tensor whose first dimension is the batch size holds one slice per frame;
+// any other tensor has no batch dimension and is shared by every frame.
+class FrameOutput {
+ public:
+  FrameOutput() : index_(0), batch_size_(1) {}
+  FrameOutput(shared_ptr<tensors_struct> batch, size_t index,
+              size_t batch_size = 1,
+              const ImageTransform &transform = ImageTransform())
+      : batch_(batch),
+        index_(index),
+        batch_size_(batch_size),
+        transform_(transform) {}
+
+  size_t num_tensors() const { return batch_->num_tensors; }
+  const char *name(size_t i) const { return batch_->names[i]; }
+  tensor_data_type data_type(size_t i) const { return batch_->data_types[i]; }
+  size_t rank(size_t i) const { return batch_->ranks[i]; }
+  // Dimension `d` of tensor `i`, with a batch dimension of 1
+  size_t shape(size_t i, size_t d) const {
+    return d == 0 && batched(i) ? 1 : batch_->shapes[i][d];
+  }
+  // Data of tensor `i` for this frame, nullptr if the tensor is empty, a
+  // scalar or of an unknown data type
+  const void *data(size_t i) const {
+    if (rank(i) == 0 || batch_->shapes[i][0] == 0) {
+      return nullptr;
+    }
+    const size_t tensor_bytes = tensor_size_in_bytes(batch_.get(), i);
+    if (tensor_bytes == 0) {
+      return nullptr;
+    }
+    if (!batched(i)) {
+      return batch_->data[i];
+    }
+    return static_cast<const uint8_t *>(batch_->data[i]) +
+           index_ * (tensor_bytes / batch_size_);
+  }
+  // Geometry of the preprocessing of the frame, to map its boxes back to
+  // its source image
+  const ImageTransform &transform() const { return transform_; }
+
+ private:
+  // Whether the first dimension of tensor `i` is the batch dimension
+  bool batched(size_t i) const {
+    return rank(i) > 0 && batch_->shapes[i][0] == batch_size_;
+  }
+
+  shared_ptr<tensors_struct> batch_;
+  size_t index_;
+  size_t batch_size_;  // Frames of the request
+  ImageTransform transform_;
+};
+
+// Split the output tensors of a batch of `batch_size` frames, whose ownership
+// is transferred, into one view per frame, with the transforms of the frames
+// if any. The outputs are freed with the `deallocate` of the runtime instance
+// that returned them once the last view is gone, which must happen before
+// that instance is destroyed.
+vector<FrameOutput> split_batch(
+    tensors_struct *outputs, size_t batch_size, void (*deallocate)(void *),
+    const vector<ImageTransform> &transforms = vector<ImageTransform>()) {
+  shared_ptr<tensors_struct> batch(outputs, [deallocate](tensors_struct *t) {
+    free_tensors(t, deallocate);
+  });
+  vector<FrameOutput> frames;
+  frames.reserve(batch_size);
+  for (size_t n = 0; n < batch_size; ++n) {
+    frames.emplace_back(batch, n, batch_size,
+                        n < transforms.size() ? transforms[n]
+                                              : ImageTransform());
+  }
+  return frames;
+}
@@ -3,7 +3,8 @@
 // This function uses the CLI11 library to handle command line options
 int parse_command_line(int argc, char **argv, string &library_path,
                        string &model_path, string &input_path,
-                       string &config_path, string &log_file, int &log_level) {
+                       string &config_path, string &log_file, int &log_level,
+                       int &num_instances) {
   CLI::App app{"OAAX inference engine command line tool"};
 
   app.add_option("-l,--library", library_path,
@@ -24,6 +25,12 @@ int parse_command_line(int argc, char **argv, string &library_path,
                  "Path to the configuration JSON file")
       ->required();
 
+  app.add_option("--instances", num_instances,
+                 "Number of isolated instances of the runtime to load, "
+                 "each with its own copy of the model (Linux only)")
+      ->default_val(1)
+      ->check(CLI::Range(1, 16));
+
   // Optional help flag
   app.set_help_flag("-h,--help", "Display this help message");
 
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Limit of the requests in flight, per runtime instance, from the optional
+// "window" object of the JSON config. With `adaptive` the window is tuned
+// between `min` and `max` by an AimdController, otherwise it stays at
+// `initial`.
+struct WindowConfig {
+  int initial = 10;
+  int min = 1;
+  int max = 64;
+  bool adaptive = false;
+  // Latency objective of a request, 0 for none
+  chrono::microseconds latency_slo{0};
+};
+
+WindowConfig parse_window_config(const nlohmann::json &config) {
+  WindowConfig window;
+  if (!config.contains("window")) {
+    return window;
+  }
+  const nlohmann::json &section = config["window"];
+  if (section.contains("initial")) {
+    window.initial = section["initial"].get<int>();
+  }
+  if (section.contains("min")) {
+    window.min = section["min"].get<int>();
+  }
+  if (section.contains("max")) {
+    window.max = section["max"].get<int>();
+  }
+  if (section.contains("adaptive")) {
+    window.adaptive = section["adaptive"].get<bool>();
+  }
+  if (section.contains("latency_slo_us")) {
+    window.latency_slo =
+        chrono::microseconds(section["latency_slo_us"].get<int64_t>());
+  }
+  if (window.min < 1 || window.initial < window.min ||
+      window.max < window.initial || window.latency_slo.count() < 0) {
+    spdlog::error(
+        "The window requires 1 <= min <= initial <= max and "
+        "latency_slo_us >= 0.");
+    exit(EXIT_FAILURE);
+  }
+  return window;
+}
+
+// Number of requests in flight, and how many may be.
+// The sender takes a slot before each send and the receiver gives it back as
+// soon as an output is received, waking the sender immediately. The size can
+// change at any time; shrinking it lets the requests in flight complete.
+class InflightWindow {
+ public:
+  explicit InflightWindow(int size) : size_(size), in_flight_(0) {}
+
+  // Take a slot, waiting at most `timeout` for one to be available.
+  // Returns false on timeout.
+  bool acquire_for(chrono::milliseconds timeout) {
+    unique_lock<mutex> lock(mutex_);
+    if (!available_.wait_for(lock, timeout,
+                             [this] { return in_flight_ < size_; })) {
+      return false;
+    }
+    in_flight_++;
+    return true;
+  }
+
+  // Give `count` slots back
+  void release(int count = 1) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      in_flight_ -= count;
+    }
+    available_.notify_all();
+  }
+
+  void resize(int size) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      size_ = size;
+    }
+    available_.notify_all();
+  }
+
+  int size() {
+    lock_guard<mutex> lock(mutex_);
+    return size_;
+  }
+
+  // Forget the requests in flight, e.g. of an interrupted run
+  void reset(int size) {
+    {
+      lock_guard<mutex> lock(mutex_);
+      size_ = size;
+      in_flight_ = 0;
+    }
+    available_.notify_all();
+  }
+
+ private:
+  mutex mutex_;
+  condition_variable available_;
+  int size_;
+  int in_flight_;
+};
+
+// Additive-increase, multiplicative-decrease tuning of the in-flight window,
+// over epochs of at least one window worth of completed requests.
+// The window grows by one request per instance every epoch, as long as the
+// runtimes keep up. It is cut by a third when the mean latency of an epoch
+// exceeds the SLO, or when requests start queueing: the latency rises well
+// above the lowest one seen without any gain in throughput.
+class AimdController {
+ public:
+  AimdController(const WindowConfig &config, int num_instances)
+      : step_(num_instances),
+        min_(config.min * num_instances),
+        max_(config.max * num_instances),
+        initial_(config.initial * num_instances),
+        latency_slo_(config.latency_slo),
+        window_(initial_) {}
+
+  // Record the latency of a completed request.
+  // Returns true if the window changed.
+  bool on_complete(chrono::microseconds latency) {
+    const auto now = chrono::steady_clock::now();
+    if (epoch_requests_ == 0) {
+      epoch_start_ = now;
+    }
+    epoch_requests_++;
+    epoch_latency_us_ += latency.count();
+    const double elapsed_s =
+        chrono::duration<double>(now - epoch_start_).count();
+    int epoch_length = window_;
+    if (epoch_length < kMinEpochRequests) {
+      epoch_length = kMinEpochRequests;
+    }
+    if (epoch_requests_ < epoch_length || elapsed_s <= 0) {
+      return false;
+    }
+    const double throughput = epoch_requests_ / elapsed_s;
+    const double mean_latency_us =
+        static_cast<double>(epoch_latency_us_) / epoch_requests_;
+    epoch_requests_ = 0;
+    epoch_latency_us_ = 0;
+    if (lowest_latency_us_ == 0 || mean_latency_us < lowest_latency_us_) {
+      lowest_latency_us_ = mean_latency_us;
+    }
+
+    const bool over_slo = latency_slo_.count() > 0 &&
+                          mean_latency_us > latency_slo_.count();
+    const bool queueing =
+        mean_latency_us > kQueueingFactor * lowest_latency_us_ &&
+        throughput < kMinGain * last_throughput_;
+    last_throughput_ = throughput;
+    const int window = window_;
+    int next = window;
+    if (over_slo || queueing) {
+      next = max(min_, static_cast<int>(window * kDecreaseFactor));
+    } else {
+      next = min(max_, window + step_);
+    }
+    if (next == window) {
+      return false;
+    }
+    window_ = next;
+    spdlog::debug(
+        "In-flight window: {} -> {} ({:.0f} requests/s, {:.0f} us mean "
+        "latency{})",
+        window, next, throughput, mean_latency_us,
+        over_slo ? ", over the SLO" : (queueing ? ", queueing" : ""));
+    return true;
+  }
+
+  // Current window, for all instances together
+  int window() const { return window_; }
+
+  // Start over from the initial window, without any epoch
+  void reset() {
+    window_ = initial_;
+    epoch_requests_ = 0;
+    epoch_latency_us_ = 0;
+    lowest_latency_us_ = 0;
+    last_throughput_ = 0;
+  }
+
+ private:
+  static constexpr int kMinEpochRequests = 16;
+  // Latency rise over the lowest one that is taken as queueing
+  static constexpr double kQueueingFactor = 1.5;
+  // Throughput gain that justifies a latency rise
+  static constexpr double kMinGain = 1.05;
+  static constexpr double kDecreaseFactor = 2.0 / 3.0;
+
+  const int step_;
+  const int min_;
+  const int max_;
+  const int initial_;
+  const chrono::microseconds latency_slo_;
+  atomic<int> window_;
+  // Only used by the receiving thread
+  chrono::steady_clock::time_point epoch_start_;
+  int epoch_requests_ = 0;
+  int64_t epoch_latency_us_ = 0;
+  double lowest_latency_us_ = 0;
+  double last_throughput_ = 0;
+};
@@ -2,7 +2,8 @@
 spdlog::logger initialize_logger(const string &log_file,
                                  int file_level = spdlog::level::info,
                                  int console_level = spdlog::level::info,
-                                 const string prefix = "OAAX") {
+                                 const string prefix = "OAAX",
+                                 function<void()> on_thread_start = [] {}) {
     try {
         // Create a console logger
         auto console_sink = make_shared<spdlog::sinks::stdout_color_sink_mt>();
@@ -15,9 +16,10 @@ spdlog::logger initialize_logger(const string &log_file,
         file_sink->set_level(
             static_cast<spdlog::level::level_enum>(file_level));
 
-        // Configure the thread pool for async logging
-        static auto thread_pool =
-            make_shared<spdlog::details::thread_pool>(8192, 1);
+        // Configure the thread pool for async logging, whose thread runs
+        // `on_thread_start` first, e.g. to pin itself to a core
+        static auto thread_pool = make_shared<spdlog::details::thread_pool>(
+            8192, 1, on_thread_start);
 
         // Create the async logger with both sinks using the thread pool
         auto logger = make_shared<spdlog::async_logger>(
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Non-maximum suppression, from the optional "nms" object of the JSON config
+struct NmsConfig {
+  // Overlap above which the lower scored of two detections is dropped
+  float iou_threshold = 0.45f;
+  // Best detections kept before the suppression, 0 for all of them
+  size_t top_k = 1000;
+  // Detections kept after the suppression
+  size_t max_detections = 300;
+  // Suppress overlapping detections of different classes too
+  bool class_agnostic = false;
+};
+
+NmsConfig parse_nms_config(const nlohmann::json &config) {
+  NmsConfig nms;
+  if (!config.contains("nms")) {
+    return nms;
+  }
+  const nlohmann::json &section = config["nms"];
+  if (section.contains("iou_threshold")) {
+    nms.iou_threshold = section["iou_threshold"].get<float>();
+  }
+  if (section.contains("top_k")) {
+    nms.top_k = section["top_k"].get<size_t>();
+  }
+  if (section.contains("max_detections")) {
+    nms.max_detections = section["max_detections"].get<size_t>();
+  }
+  if (section.contains("class_agnostic")) {
+    nms.class_agnostic = section["class_agnostic"].get<bool>();
+  }
+  if (nms.iou_threshold < 0 || nms.iou_threshold > 1 ||
+      nms.max_detections < 1) {
+    spdlog::error(
+        "The NMS requires 0 <= iou_threshold <= 1 and max_detections >= 1.");
+    exit(EXIT_FAILURE);
+  }
+  return nms;
+}
+
+// Greedy non-maximum suppression that stays fast with many candidates.
+// Only the top_k best candidates are ranked, with a partial sort, and each
+// detection kept is only compared to the candidates in the cells of a grid
+// it covers, instead of to all of them. Cells are about the mean size of a
+// box, so a box covers a few of them.
+// The buffers are reused from call to call, so an engine should not be
+// shared between threads.
+class NmsEngine {
+ public:
+  explicit NmsEngine(const NmsConfig &config) : config_(config) {}
+
+  // Keep the best of the overlapping detections, by decreasing score. Only
+  // detections of the same class overlap, unless class_agnostic.
+  void run(vector<Detection> &detections) {
+    const auto by_score = [](const Detection &a, const Detection &b) {
+      return a.score > b.score;
+    };
+    if (config_.top_k > 0 && detections.size() > config_.top_k) {
+      nth_element(detections.begin(), detections.begin() + config_.top_k,
+                  detections.end(), by_score);
+      detections.resize(config_.top_k);
+    }
+    sort(detections.begin(), detections.end(), by_score);
+    if (detections.empty()) {
+      return;
+    }
+    build_grid(detections);
+
+    const size_t count = detections.size();
+    suppressed_.assign(count, 0);
+    seen_by_.assign(count, kNone);
+    size_t kept = 0;
+    for (uint32_t i = 0; i < count && kept < config_.max_detections; ++i) {
+      if (suppressed_[i]) {
+        continue;
+      }
+      const Detection best = detections[i];
+      detections[kept++] = best;
+      // Suppress the lower scored candidates it overlaps, which share one of
+      // its cells
+      int col0, row0, col1, row1;
+      cell_range(best, col0, row0, col1, row1);
+      for (int row = row0; row <= row1; ++row) {
+        for (int col = col0; col <= col1; ++col) {
+          const size_t cell = static_cast<size_t>(row) * cols_ + col;
+          // Cells list their candidates by decreasing score
+          const uint32_t *first = cell_boxes_.data() + cell_start_[cell];
+          const uint32_t *last = cell_boxes_.data() + cell_start_[cell + 1];
+          for (const uint32_t *j = upper_bound(first, last, i); j != last;
+               ++j) {
+            if (suppressed_[*j] || seen_by_[*j] == i) {
+              continue;
+            }
+            seen_by_[*j] = i;
+            const Detection &other = detections[*j];
+            if ((config_.class_agnostic || other.class_id == best.class_id) &&
+                overlaps(best, other)) {
+              suppressed_[*j] = 1;
+            }
+          }
+        }
+      }
+    }
+    detections.resize(kept);
+  }
+
+  // Suppress the detections of every frame of a batch, independently
+  void run_batch(vector<vector<Detection>> &frames) {
+    for (vector<Detection> &detections : frames) {
+      run(detections);
+    }
+  }
+
+ private:
+  static constexpr uint32_t kNone = UINT32_MAX;
+  static constexpr int kMaxGridSide = 64;
+
+  // IoU above the threshold, without dividing
+  bool overlaps(const Detection &a, const Detection &b) const {
+    const float width = min(a.x2, b.x2) - max(a.x1, b.x1);
+    const float height = min(a.y2, b.y2) - max(a.y1, b.y1);
+    if (width <= 0 || height <= 0) {
+      return false;
+    }
+    const float intersection = width * height;
+    const float area_a = (a.x2 - a.x1) * (a.y2 - a.y1);
+    const float area_b = (b.x2 - b.x1) * (b.y2 - b.y1);
+    return intersection >
+           config_.iou_threshold * (area_a + area_b - intersection);
+  }
+
+  // Cells covered by a box, clamped to the grid
+  void cell_range(const Detection &box, int &col0, int &row0, int &col1,
+                  int &row1) const {
+    const auto to_cell = [](float position, float cell, int cells) {
+      const float index = floor(position / cell);
+      if (!(index >= 0)) {  // Also catches NaN
+        return 0;
+      }
+      return index >= cells ? cells - 1 : static_cast<int>(index);
+    };
+    col0 = to_cell(box.x1 - min_x_, cell_width_, cols_);
+    col1 = to_cell(box.x2 - min_x_, cell_width_, cols_);
+    row0 = to_cell(box.y1 - min_y_, cell_height_, rows_);
+    row1 = to_cell(box.y2 - min_y_, cell_height_, rows_);
+  }
+
+  // Lay the candidates out in a grid covering all of them, each listed in
+  // every cell it covers, in rank order
+  void build_grid(const vector<Detection> &detections) {
+    min_x_ = min_y_ = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY;
+    double total_size = 0;
+    for (const Detection &box : detections) {
+      min_x_ = min(min_x_, box.x1);
+      min_y_ = min(min_y_, box.y1);
+      max_x = max(max_x, box.x2);
+      max_y = max(max_y, box.y2);
+      total_size += max(box.x2 - box.x1, box.y2 - box.y1);
+    }
+    const float cell_size =
+        max(1.0f, static_cast<float>(total_size / detections.size()));
+    const auto cells_along = [cell_size](float extent) {
+      const float cells = ceil(extent / cell_size);
+      if (!(cells >= 1)) {
+        return 1;
+      }
+      return cells > kMaxGridSide ? kMaxGridSide : static_cast<int>(cells);
+    };
+    cols_ = cells_along(max_x - min_x_);
+    rows_ = cells_along(max_y - min_y_);
+    cell_width_ = max(1e-6f, (max_x - min_x_) / cols_);
+    cell_height_ = max(1e-6f, (max_y - min_y_) / rows_);
+
+    // Count the candidates of every cell, then list them
+    const size_t cells = static_cast<size_t>(rows_) * cols_;
+    cell_start_.assign(cells + 1, 0);
+    for (const Detection &box : detections) {
+      int col0, row0, col1, row1;
+      cell_range(box, col0, row0, col1, row1);
+      for (int row = row0; row <= row1; ++row) {
+        for (int col = col0; col <= col1; ++col) {
+          cell_start_[static_cast<size_t>(row) * cols_ + col + 1]++;
+        }
+      }
+    }
+    for (size_t cell = 0; cell < cells; ++cell) {
+      cell_start_[cell + 1] += cell_start_[cell];
+    }
+    cell_boxes_.resize(cell_start_[cells]);
+    cell_fill_.assign(cell_start_.begin(), cell_start_.end() - 1);
+    for (uint32_t i = 0; i < detections.size(); ++i) {
+      int col0, row0, col1, row1;
+      cell_range(detections[i], col0, row0, col1, row1);
+      for (int row = row0; row <= row1; ++row) {
+        for (int col = col0; col <= col1; ++col) {
+          cell_boxes_[cell_fill_[static_cast<size_t>(row) * cols_ + col]++] =
+              i;
+        }
+      }
+    }
+  }
+
+  NmsConfig config_;
+  // Grid
+  float min_x_ = 0, min_y_ = 0;
+  float cell_width_ = 1, cell_height_ = 1;
+  int cols_ = 1, rows_ = 1;
+  vector<uint32_t> cell_start_;  // Offsets of the cells in cell_boxes_
+  vector<uint32_t> cell_boxes_;  // Candidates of every cell
+  vector<uint32_t> cell_fill_;
+  // Suppression
+  vector<uint8_t> suppressed_;
+  // Last detection kept that compared itself to a candidate, as a candidate
+  // can share several cells with it
+  vector<uint32_t> seen_by_;
+};
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Object found in a frame, in pixels of the model input until mapped back to
+// the source image by `map_to_source`
+struct Detection {
+  float x1, y1;  // Top-left corner
+  float x2, y2;  // Bottom-right corner
+  float score;
+  int class_id;
+};
+
+// Decoding of the outputs, from the optional "postprocess" object of the JSON
+// config
+struct PostprocessConfig {
+  // Lowest class score of a detection
+  float score_threshold = 0.25f;
+  // Output tensor of the detection head, the first float, uint8 or int8 one
+  // of rank 3 by default
+  string output_name;
+  // Quantization of an integer detection head: x = (q - zero_point) * scale
+  float output_scale = 1.0f;
+  int output_zero_point = 0;
+};
+
+PostprocessConfig parse_postprocess_config(const nlohmann::json &config) {
+  PostprocessConfig postprocess;
+  if (!config.contains("postprocess")) {
+    return postprocess;
+  }
+  const nlohmann::json &section = config["postprocess"];
+  if (section.contains("score_threshold")) {
+    postprocess.score_threshold = section["score_threshold"].get<float>();
+  }
+  if (section.contains("output_name")) {
+    postprocess.output_name = section["output_name"].get<string>();
+  }
+  if (section.contains("output_scale")) {
+    postprocess.output_scale = section["output_scale"].get<float>();
+  }
+  if (section.contains("output_zero_point")) {
+    postprocess.output_zero_point = section["output_zero_point"].get<int>();
+  }
+  if (postprocess.score_threshold < 0 || postprocess.score_threshold > 1 ||
+      !(postprocess.output_scale > 0)) {
+    spdlog::error(
+        "The postprocessing requires 0 <= score_threshold <= 1 and "
+        "output_scale > 0.");
+    exit(EXIT_FAILURE);
+  }
+  return postprocess;
+}
+
+// Anchors whose best class is found in one go, small enough for the scratch
+// buffers to stay on the stack and in the L1 cache
+constexpr size_t kAnchorBlock = 1024;
+
+// Decode a YOLOv8 detection head of `num_anchors` anchors, laid out
+// channel-major as [4 + num_classes, num_anchors]: the rows of the box
+// centers, widths and heights, then one row of scores per class.
+// The head is read in place, without transposing it: the best class of a
+// block of anchors is found row by row with vector compares, and boxes are
+// only built for the anchors above the threshold, a small fraction of them.
+// Appends the detections to `detections`.
+void decode_yolov8_head(const float *head, size_t num_channels,
+                        size_t num_anchors, float score_threshold,
+                        vector<Detection> &detections) {
+  const ScoreKernels &kernels = score_kernels();
+  const size_t num_classes = num_channels - 4;
+  const float *scores = head + 4 * num_anchors;
+  float max_score[kAnchorBlock];
+  int32_t max_class[kAnchorBlock];
+  uint32_t candidates[kAnchorBlock];
+  for (size_t first = 0; first < num_anchors; first += kAnchorBlock) {
+    const size_t n = min(kAnchorBlock, num_anchors - first);
+    kernels.max_score(scores + first, num_classes, num_anchors, n, max_score,
+                      max_class);
+    const size_t count =
+        kernels.select_above(max_score, n, score_threshold, candidates);
+    for (size_t k = 0; k < count; ++k) {
+      const size_t i = candidates[k];
+      const size_t anchor = first + i;
+      const float cx = head[anchor];
+      const float cy = head[num_anchors + anchor];
+      const float half_width = head[2 * num_anchors + anchor] / 2;
+      const float half_height = head[3 * num_anchors + anchor] / 2;
+      detections.push_back({cx - half_width, cy - half_height,
+                            cx + half_width, cy + half_height, max_score[i],
+                            max_class[i]});
+    }
+  }
+}
+
+// Decode a quantized YOLOv8 detection head, see decode_yolov8_head, of uint8
+// codes, or of int8 ones if `is_signed`.
+// The threshold is brought to the integer domain once, so the scores of all
+// the anchors are compared as 8-bit codes, 16 or 32 per vector, and only the
+// few anchors above it are dequantized.
+void decode_yolov8_head_quantized(const uint8_t *head, bool is_signed,
+                                  size_t num_channels, size_t num_anchors,
+                                  const PostprocessConfig &config,
+                                  vector<Detection> &detections) {
+  const ScoreKernels &kernels = score_kernels();
+  // Codes are compared as uint8, int8 ones once their sign bit is flipped
+  const uint8_t flip = is_signed ? 0x80 : 0x00;
+  const auto dequantize = [&config, is_signed](uint8_t code) {
+    const int q = is_signed ? static_cast<int8_t>(code) : code;
+    return (q - config.output_zero_point) * config.output_scale;
+  };
+  // Lowest flipped code whose score passes the threshold, exactly as the
+  // dequantized scores would
+  int threshold = 256;
+  for (int code = 0; code < 256; ++code) {
+    if (dequantize(static_cast<uint8_t>(code ^ flip)) >
+        config.score_threshold) {
+      threshold = code;
+      break;
+    }
+  }
+  if (threshold == 256) {
+    return;  // No score can pass it
+  }
+  const size_t num_classes = num_channels - 4;
+  const uint8_t *scores = head + 4 * num_anchors;
+  uint8_t max_code[kAnchorBlock];
+  uint32_t candidates[kAnchorBlock];
+  for (size_t first = 0; first < num_anchors; first += kAnchorBlock) {
+    const size_t n = min(kAnchorBlock, num_anchors - first);
+    kernels.max_code(scores + first, num_classes, num_anchors, n, flip,
+                     max_code);
+    const size_t count = kernels.select_at_least(
+        max_code, n, static_cast<uint8_t>(threshold), candidates);
+    for (size_t k = 0; k < count; ++k) {
+      const size_t i = candidates[k];
+      const size_t anchor = first + i;
+      // The first class with the best code, as for float heads
+      int class_id = 0;
+      while ((scores[class_id * num_anchors + anchor] ^ flip) != max_code[i]) {
+        class_id++;
+      }
+      const float cx = dequantize(head[anchor]);
+      const float cy = dequantize(head[num_anchors + anchor]);
+      const float half_width = dequantize(head[2 * num_anchors + anchor]) / 2;
+      const float half_height = dequantize(head[3 * num_anchors + anchor]) / 2;
+      detections.push_back({cx - half_width, cy - half_height,
+                            cx + half_width, cy + half_height,
+                            dequantize(max_code[i] ^ flip), class_id});
+    }
+  }
+}
+
+// Index of the output tensor holding the detection head, or -1 if there is
+// none
+int find_detection_head(const FrameOutput &output, const string &name) {
+  for (size_t i = 0; i < output.num_tensors(); ++i) {
+    if (!name.empty()) {
+      if (name == output.name(i)) {
+        return static_cast<int>(i);
+      }
+    } else if ((output.data_type(i) == DATA_TYPE_FLOAT ||
+                output.data_type(i) == DATA_TYPE_UINT8 ||
+                output.data_type(i) == DATA_TYPE_INT8) &&
+               output.rank(i) == 3 && output.shape(i, 1) > 4) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+// Decode the detections of one frame, see decode_yolov8_head, from a float
+// head or a quantized one.
+// Returns false if its outputs hold no YOLOv8 detection head.
+bool decode_yolov8(const FrameOutput &output, const PostprocessConfig &config,
+                   vector<Detection> &detections) {
+  const int head = find_detection_head(output, config.output_name);
+  if (head < 0 || output.rank(head) != 3 || output.shape(head, 1) <= 4) {
+    return false;
+  }
+  const void *data = output.data(head);
+  if (!data) {
+    return false;
+  }
+  const size_t num_channels = output.shape(head, 1);
+  const size_t num_anchors = output.shape(head, 2);
+  switch (output.data_type(head)) {
+    case DATA_TYPE_FLOAT:
+      decode_yolov8_head(static_cast<const float *>(data), num_channels,
+                         num_anchors, config.score_threshold, detections);
+      return true;
+    case DATA_TYPE_UINT8:
+    case DATA_TYPE_INT8:
+      decode_yolov8_head_quantized(
+          static_cast<const uint8_t *>(data),
+          output.data_type(head) == DATA_TYPE_INT8, num_channels, num_anchors,
+          config, detections);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Map the boxes of `detections` from the model input back to the source image
+// of the frame, in one vectorized pass, undoing the scaling and padding of
+// its preprocessing. Boxes are clipped to the region of the source image
+// that was kept.
+void map_to_source(const ImageTransform &transform,
+                   vector<Detection> &detections) {
+  static_assert(offsetof(Detection, y1) == offsetof(Detection, x1) + 4 &&
+                    offsetof(Detection, x2) == offsetof(Detection, x1) + 8 &&
+                    offsetof(Detection, y2) == offsetof(Detection, x1) + 12 &&
+                    sizeof(Detection) % sizeof(float) == 0,
+                "The corners of a detection must be 4 contiguous floats");
+  if (detections.empty()) {
+    return;
+  }
+  // source = (model - offset) / scale + crop origin
+  const float inverse_x = 1 / transform.scale_x;
+  const float inverse_y = 1 / transform.scale_y;
+  const float bias_x = transform.crop_x - transform.offset_x * inverse_x;
+  const float bias_y = transform.crop_y - transform.offset_y * inverse_y;
+  const float scale[4] = {inverse_x, inverse_y, inverse_x, inverse_y};
+  const float bias[4] = {bias_x, bias_y, bias_x, bias_y};
+  // No crop, no clipping
+  const bool clip = transform.crop_width > 0 && transform.crop_height > 0;
+  const float left = clip ? transform.crop_x : -INFINITY;
+  const float top = clip ? transform.crop_y : -INFINITY;
+  const float right = clip ? transform.crop_x + transform.crop_width : INFINITY;
+  const float bottom =
+      clip ? transform.crop_y + transform.crop_height : INFINITY;
+  const float low[4] = {left, top, left, top};
+  const float high[4] = {right, bottom, right, bottom};
+  box_kernels().map_boxes(&detections.front().x1, detections.size(),
+                          sizeof(Detection) / sizeof(float), scale, bias, low,
+                          high);
+}
@@ -1,19 +1,332 @@
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+// clang-format off
+#include <jpeglib.h>  // Jpeglib should always be included after stdio.h
+// clang-format on
+
+// libjpeg-turbo can decode a cropped region of the image directly into BGR
+#if defined(JCS_EXTENSIONS) && defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+    LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define OAAX_JPEG_CROP_DECODE 1
+#endif
 
 enum ResizeMethod { LETTERBOX, CROP_THEN_RESIZE, SQUASH };
 
+// Geometry of the preprocessing of an image, to map the boxes found in the
+// model input back to the source image. A point of the source image lands at
+//   model = (source - crop origin) * scale + offset
+// in the model input. The source image is the one on disk, as displayed once
+// its EXIF orientation is applied, at full resolution.
+struct ImageTransform {
+    float scale_x = 1, scale_y = 1;
+    float offset_x = 0, offset_y = 0;  // Padding of the letterbox
+    // Region of the source image that is kept, empty for no crop at all
+    float crop_x = 0, crop_y = 0;
+    float crop_width = 0, crop_height = 0;
+};
+
+// Header information of a JPEG image
+struct JpegHeader {
+    int width;
+    int height;
+    int orientation;  // EXIF orientation, 1 when absent
+};
+
+// Read the EXIF orientation from the payload of an APP1 segment, if any
+int read_exif_orientation(const std::vector<unsigned char> &payload) {
+    const size_t tiff = 6;  // After "Exif\0\0"
+    if (payload.size() < tiff + 8 ||
+        std::memcmp(payload.data(), "Exif\0\0", 6) != 0) {
+        return 1;
+    }
+    const bool little_endian = payload[tiff] == 'I';
+    auto read16 = [&](size_t offset) -> int {
+        return little_endian ? payload[offset] | (payload[offset + 1] << 8)
+                             : (payload[offset] << 8) | payload[offset + 1];
+    };
+    auto read32 = [&](size_t offset) -> size_t {
+        return little_endian ? static_cast<size_t>(read16(offset)) |
+                                   (static_cast<size_t>(read16(offset + 2))
+                                    << 16)
+                             : (static_cast<size_t>(read16(offset)) << 16) |
+                                   static_cast<size_t>(read16(offset + 2));
+    };
+    const size_t ifd = tiff + read32(tiff + 4);
+    if (ifd + 2 > payload.size()) {
+        return 1;
+    }
+    const int entries = read16(ifd);
+    for (int i = 0; i < entries; ++i) {
+        const size_t entry = ifd + 2 + 12 * i;
+        if (entry + 12 > payload.size()) {
+            break;
+        }
+        if (read16(entry) == 0x0112) {
+            const int orientation = read16(entry + 8);
+            return orientation >= 1 && orientation <= 8 ? orientation : 1;
+        }
+    }
+    return 1;
+}
+
+// Read the dimensions and orientation of a JPEG image from its headers,
+// without decoding it.
+// Returns false if the file is not a JPEG or the header could not be parsed.
+bool read_jpeg_header(const std::string &image_path, JpegHeader &header) {
+    std::ifstream file(image_path, std::ios::binary);
+    if (!file || file.get() != 0xFF || file.get() != 0xD8) {
+        return false;
+    }
+    header.orientation = 1;
+    while (file) {
+        // Find the next marker, skipping fill bytes
+        int marker = file.get();
+        if (marker != 0xFF) {
+            return false;
+        }
+        while (marker == 0xFF) {
+            marker = file.get();
+        }
+        if (marker == EOF || marker == 0xD9 || marker == 0xDA) {
+            return false;  // End of image or start of scan before any SOF
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue;  // Standalone markers have no payload
+        }
+        int length = (file.get() << 8) | file.get();
+        if (length < 2) {
+            return false;
+        }
+        // SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+            marker != 0xC8 && marker != 0xCC) {
+            file.get();  // Sample precision
+            header.height = (file.get() << 8) | file.get();
+            header.width = (file.get() << 8) | file.get();
+            return file.good() && header.width > 0 && header.height > 0;
+        }
+        if (marker == 0xE1) {
+            std::vector<unsigned char> payload(length - 2);
+            file.read(reinterpret_cast<char *>(payload.data()),
+                      payload.size());
+            if (header.orientation == 1) {
+                header.orientation = read_exif_orientation(payload);
+            }
+            continue;
+        }
+        file.seekg(length - 2, std::ios::cur);
+    }
+    return false;
+}
+
+// Largest JPEG reduction (1, 2, 4 or 8) that still decodes the region used by
+// `resize_method` at no less than its target resolution.
+int choose_jpeg_reduction(const JpegHeader &header, int target_width,
+                          int target_height, ResizeMethod resize_method) {
+    // Orientations 5 to 8 transpose the image once decoded
+    int width = header.orientation >= 5 ? header.height : header.width;
+    int height = header.orientation >= 5 ? header.width : header.height;
+    // Size of the source region and of the image it is resized to
+    int region_width = width, region_height = height;
+    int output_width = target_width, output_height = target_height;
+    if (resize_method == LETTERBOX) {
+        float scale = std::min(static_cast<float>(target_width) / width,
+                               static_cast<float>(target_height) / height);
+        output_width = static_cast<int>(width * scale);
+        output_height = static_cast<int>(height * scale);
+    } else if (resize_method == CROP_THEN_RESIZE) {
+        region_width = region_height = std::min(width, height);
+    }
+    for (int reduction = 8; reduction > 1; reduction /= 2) {
+        if (region_width / reduction >= output_width &&
+            region_height / reduction >= output_height) {
+            return reduction;
+        }
+    }
+    return 1;
+}
+
+// Pick the IMREAD_REDUCED_COLOR_* flag matching `choose_jpeg_reduction`.
+// Only JPEGs are decoded at reduced scale (in the DCT domain); any other
+// format is read at full resolution.
+// `source_size` is set to the full resolution of a JPEG, once oriented, and
+// left untouched otherwise.
+int choose_imread_flags(const std::string &image_path, int target_width,
+                        int target_height, ResizeMethod resize_method,
+                        cv::Size &source_size) {
+    JpegHeader header;
+    if (!read_jpeg_header(image_path, header)) {
+        return cv::IMREAD_COLOR;
+    }
+    // Orientations 5 to 8 transpose the image once decoded
+    source_size = header.orientation >= 5
+                      ? cv::Size(header.height, header.width)
+                      : cv::Size(header.width, header.height);
+    int reduction = choose_jpeg_reduction(header, target_width, target_height,
+                                          resize_method);
+    spdlog::debug("Decoding {}x{} image at 1/{} scale.", header.width,
+                  header.height, reduction);
+    switch (reduction) {
+        case 8:
+            return cv::IMREAD_REDUCED_COLOR_8;
+        case 4:
+            return cv::IMREAD_REDUCED_COLOR_4;
+        case 2:
+            return cv::IMREAD_REDUCED_COLOR_2;
+        default:
+            return cv::IMREAD_COLOR;
+    }
+}
+
+#ifdef OAAX_JPEG_CROP_DECODE
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<JpegErrorManager *>(cinfo->err)->setjmp_buffer,
+            1);
+}
+
+// Decode the centered square of the JPEG at 1/`reduction` scale, into
+// `buffer`. Only the MCU-aligned columns and the rows of the square are
+// decoded. On success, `crop` is the exact square within `buffer`, and
+// `transform` crops that square out of the full resolution image.
+// No object with a destructor may be created in here: libjpeg errors
+// longjmp back to the setjmp below.
+bool decode_jpeg_center_square(FILE *input_file, int reduction,
+                               cv::Mat &buffer, cv::Rect &crop,
+                               ImageTransform &transform) {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, input_file);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = reduction;
+    cinfo.out_color_space = JCS_EXT_BGR;
+    jpeg_start_decompress(&cinfo);
+
+    JDIMENSION size = std::min(cinfo.output_width, cinfo.output_height);
+    JDIMENSION x_offset = (cinfo.output_width - size) / 2;
+    JDIMENSION y_offset = (cinfo.output_height - size) / 2;
+    // Source pixels per decoded pixel, the reduced size being rounded up.
+    // Taken before the crop, which narrows the output width.
+    float source_x = static_cast<float>(cinfo.image_width) / cinfo.output_width;
+    float source_y =
+        static_cast<float>(cinfo.image_height) / cinfo.output_height;
+    // Widened to the iMCU boundaries by libjpeg
+    JDIMENSION crop_x = x_offset;
+    JDIMENSION crop_width = size;
+    jpeg_crop_scanline(&cinfo, &crop_x, &crop_width);
+    jpeg_skip_scanlines(&cinfo, y_offset);
+
+    buffer.create(size, crop_width, CV_8UC3);
+    while (cinfo.output_scanline < y_offset + size) {
+        JSAMPROW row = buffer.ptr<uint8_t>(cinfo.output_scanline - y_offset);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    transform.crop_x = x_offset * source_x;
+    transform.crop_y = y_offset * source_y;
+    transform.crop_width = size * source_x;
+    transform.crop_height = size * source_y;
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    crop = cv::Rect(x_offset - crop_x, 0, size, size);
+    return true;
+}
+#endif  // OAAX_JPEG_CROP_DECODE
+
+// Decode only the centered square of a JPEG image, as needed by
+// CROP_THEN_RESIZE, at the largest reduction that still covers the target.
+// `transform` is set to the crop of that square out of the image.
+// Returns false when the partial decode is not possible (not a JPEG, EXIF
+// rotation, or no libjpeg-turbo), in which case the caller decodes the whole
+// image.
+bool read_jpeg_center_square(const std::string &image_path, int target_width,
+                             int target_height, cv::Mat &square,
+                             ImageTransform &transform) {
+#ifdef OAAX_JPEG_CROP_DECODE
+    JpegHeader header;
+    if (!read_jpeg_header(image_path, header) || header.orientation != 1) {
+        return false;
+    }
+    int reduction = choose_jpeg_reduction(header, target_width, target_height,
+                                          CROP_THEN_RESIZE);
+    FILE *input_file = fopen(image_path.c_str(), "rb");
+    if (!input_file) {
+        return false;
+    }
+    cv::Mat buffer;
+    cv::Rect crop;
+    bool decoded = decode_jpeg_center_square(input_file, reduction, buffer,
+                                             crop, transform);
+    fclose(input_file);
+    if (!decoded) {
+        spdlog::warn("Partial JPEG decode failed, decoding the full image.");
+        return false;
+    }
+    spdlog::debug("Decoded {}x{} center square of {}x{} image at 1/{} scale.",
+                  crop.width, crop.height, header.width, header.height,
+                  reduction);
+    square = buffer(crop);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Load the image and bring it to the model input resolution.
+// The returned image is still 8-bit BGR: color conversion, normalization and
+// layout are fused into a single pass by `create_tensors`.
+// `transform` is set to the geometry of the resizing, from the source image
+// to the returned one.
 cv::Mat preprocess_image(const std::string &image_path, int target_width,
                          int target_height, ResizeMethod resize_method,
-                         const cv::Scalar &mean, const cv::Scalar &stddev) {
+                         ImageTransform &transform) {
     spdlog::info("Preprocessing image: {}", image_path);
     try {
-        // Load the image from the given path
-        cv::Mat image = cv::imread(image_path, cv::IMREAD_COLOR);
+        transform = ImageTransform();
+        cv::Mat resized_image;
+        // Only decode the region that is kept
+        cv::Mat square;
+        if (resize_method == CROP_THEN_RESIZE &&
+            read_jpeg_center_square(image_path, target_width, target_height,
+                                    square, transform)) {
+            cv::resize(square, resized_image,
+                       cv::Size(target_width, target_height));
+            transform.scale_x = target_width / transform.crop_width;
+            transform.scale_y = target_height / transform.crop_height;
+            return resized_image;
+        }
+
+        // Load the image from the given path, at reduced scale when possible
+        cv::Size source_size;
+        cv::Mat image = cv::imread(
+            image_path,
+            choose_imread_flags(image_path, target_width, target_height,
+                                resize_method, source_size));
         if (image.empty()) {
             throw std::runtime_error("Failed to load image: " + image_path);
         }
-
-        // Convert the image to RGB
-        cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+        if (source_size.width <= 0 || source_size.height <= 0) {
+            source_size = image.size();
+        }
+        // Source pixels per pixel of the possibly reduced image
+        float source_x = static_cast<float>(source_size.width) / image.cols;
+        float source_y = static_cast<float>(source_size.height) / image.rows;
+        transform.crop_width = static_cast<float>(source_size.width);
+        transform.crop_height = static_cast<float>(source_size.height);
 
         // Resize the image based on the chosen method
         if (resize_method == LETTERBOX) {
@@ -24,41 +337,41 @@ cv::Mat preprocess_image(const std::string &image_path, int target_width,
                          static_cast<float>(target_height) / original_height);
             int new_width = static_cast<int>(original_width * scale);
             int new_height = static_cast<int>(original_height * scale);
-            cv::Mat resized_image;
-            cv::resize(image, resized_image, cv::Size(new_width, new_height));
-            image = cv::Mat::zeros(target_height, target_width, image.type());
-            resized_image.copyTo(image(cv::Rect(
-                (target_width - new_width) / 2,
-                (target_height - new_height) / 2, new_width, new_height)));
-            // Free temporary images
-            resized_image.release();
+            resized_image =
+                cv::Mat::zeros(target_height, target_width, image.type());
+            // Resize straight into the padded canvas, no temporary image
+            cv::Rect region((target_width - new_width) / 2,
+                            (target_height - new_height) / 2, new_width,
+                            new_height);
+            cv::Mat roi = resized_image(region);
+            cv::resize(image, roi, cv::Size(new_width, new_height));
+            transform.scale_x = new_width / transform.crop_width;
+            transform.scale_y = new_height / transform.crop_height;
+            transform.offset_x = static_cast<float>(region.x);
+            transform.offset_y = static_cast<float>(region.y);
         } else if (resize_method == CROP_THEN_RESIZE) {
             int crop_size = std::min(image.cols, image.rows);
             cv::Rect crop_region((image.cols - crop_size) / 2,
                                  (image.rows - crop_size) / 2, crop_size,
                                  crop_size);
-            cv::Mat cropped_image = image(crop_region);
-            cv::resize(cropped_image, image,
+            cv::resize(image(crop_region), resized_image,
                        cv::Size(target_width, target_height));
-            // Free temporary images
-            cropped_image.release();
+            transform.crop_x = crop_region.x * source_x;
+            transform.crop_y = crop_region.y * source_y;
+            transform.crop_width = crop_size * source_x;
+            transform.crop_height = crop_size * source_y;
+            transform.scale_x = target_width / transform.crop_width;
+            transform.scale_y = target_height / transform.crop_height;
         } else if (resize_method == SQUASH) {
-            cv::resize(image, image, cv::Size(target_width, target_height));
+            cv::resize(image, resized_image,
+                       cv::Size(target_width, target_height));
+            transform.scale_x = target_width / transform.crop_width;
+            transform.scale_y = target_height / transform.crop_height;
         }
-        // print mean and stddev values
-        spdlog::info("Mean: {}, {}, {}", mean[0], mean[1], mean[2]);
-        spdlog::info("Stddev: {}, {}, {}", stddev[0], stddev[1], stddev[2]);
-        // Convert the image to float and normalize
-        image.convertTo(image, CV_32F);
-        // Apply mean and standard deviation normalization
-        image = image - mean;    // Subtract mean
-        image = image / stddev;  // Divide by stddev
-        // print min and max value of image
-        double min_val, max_val;
-        cv::minMaxLoc(image, &min_val, &max_val);
-        spdlog::info("Image min value: {}, max value: {}", min_val, max_val);
-
-        return image;
+        // Free the full resolution image
+        image.release();
+
+        return resized_image;
     } catch (const std::exception &e) {
         spdlog::error("Error preprocessing image: {}", e.what());
         exit(EXIT_FAILURE);
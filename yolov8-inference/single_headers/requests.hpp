@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// A request sent to the runtime
+struct InferenceRequest {
+  uint64_t id;  // Monotonically increasing, in send order
+  chrono::steady_clock::time_point sent_at;
+  size_t batch_size;  // Number of frames batched into the request
+  // Its outputs are discarded after this time
+  chrono::steady_clock::time_point deadline;
+  // Geometry of the preprocessing of its frames, in batch order
+  vector<ImageTransform> transforms;
+};
+
+// Latency histogram with bounded memory: 8 sub-buckets per power of two of
+// microseconds, so percentiles are accurate to ~12%.
+class LatencyStats {
+ public:
+  LatencyStats() : buckets_(64 * kSubBuckets, 0) {}
+
+  void add(chrono::microseconds latency) {
+    uint64_t us = static_cast<uint64_t>(max<int64_t>(latency.count(), 0));
+    buckets_[bucket_of(us)]++;
+    count_++;
+    sum_us_ += us;
+    max_us_ = max(max_us_, us);
+  }
+
+  void merge(const LatencyStats &other) {
+    for (size_t b = 0; b < buckets_.size(); ++b) {
+      buckets_[b] += other.buckets_[b];
+    }
+    count_ += other.count_;
+    sum_us_ += other.sum_us_;
+    max_us_ = max(max_us_, other.max_us_);
+  }
+
+  uint64_t count() const { return count_; }
+  double mean_us() const {
+    return count_ ? static_cast<double>(sum_us_) / count_ : 0.0;
+  }
+  uint64_t max_us() const { return max_us_; }
+
+  // Upper bound of the bucket holding the given percentile, in microseconds
+  uint64_t percentile_us(double percentile) const {
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count_);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < buckets_.size(); ++b) {
+      seen += buckets_[b];
+      if (seen > rank) {
+        return min(upper_bound_of(b), max_us_);
+      }
+    }
+    return max_us_;
+  }
+
+ private:
+  static const int kSubBuckets = 8;
+
+  static size_t bucket_of(uint64_t us) {
+    if (us < kSubBuckets) {
+      return static_cast<size_t>(us);
+    }
+    int exponent = 63 - __builtin_clzll(us);  // >= 3
+    uint64_t mantissa = (us >> (exponent - 3)) & (kSubBuckets - 1);
+    return static_cast<size_t>((exponent - 2) * kSubBuckets + mantissa);
+  }
+
+  static uint64_t upper_bound_of(size_t bucket) {
+    if (bucket < kSubBuckets) {
+      return bucket;
+    }
+    int exponent = static_cast<int>(bucket / kSubBuckets) + 2;
+    uint64_t mantissa = bucket % kSubBuckets;
+    return ((kSubBuckets + mantissa + 1) << (exponent - 3)) - 1;
+  }
+
+  vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t sum_us_ = 0;
+  uint64_t max_us_ = 0;
+};
+
+// Stamps every request with an ID and a send time, and matches the outputs
+// back to them.
+// The OAAX interface does not carry any request ID through the runtime, so
+// outputs are matched first-in first-out: this is exact for a runtime that
+// completes its requests in order. Runtimes completing out of order should
+// each get their own tracker, sharing the ID counter.
+// A runtime instance running several model duplicates (n_duplicates > 1) may
+// complete its own requests out of order, and then the latencies, deadlines
+// and transforms of its outputs are only approximate.
+class RequestTracker {
+ public:
+  explicit RequestTracker(atomic<uint64_t> *id_counter = nullptr)
+      : id_counter_(id_counter ? id_counter : &own_id_counter_),
+        own_id_counter_(0) {}
+
+  // Record a request right before it is passed to `send_input`, so that its
+  // output can not be received before it is tracked
+  InferenceRequest begin(size_t batch_size = 1,
+                         chrono::steady_clock::time_point deadline =
+                             chrono::steady_clock::time_point::max(),
+                         vector<ImageTransform> transforms = {}) {
+    lock_guard<mutex> lock(mutex_);
+    InferenceRequest request{(*id_counter_)++, chrono::steady_clock::now(),
+                             batch_size, deadline, move(transforms)};
+    in_flight_.push_back(request);
+    return request;
+  }
+
+  // Forget a request that `send_input` rejected
+  void cancel(const InferenceRequest &request) {
+    lock_guard<mutex> lock(mutex_);
+    for (auto it = in_flight_.rbegin(); it != in_flight_.rend(); ++it) {
+      if (it->id == request.id) {
+        in_flight_.erase(next(it).base());
+        return;
+      }
+    }
+  }
+
+  // Match an output to the oldest request in flight and record its latency.
+  // Returns false if no request is in flight.
+  bool complete(InferenceRequest &request, chrono::microseconds &latency) {
+    auto now = chrono::steady_clock::now();
+    lock_guard<mutex> lock(mutex_);
+    if (in_flight_.empty()) {
+      return false;
+    }
+    request = in_flight_.front();
+    in_flight_.pop_front();
+    latency = chrono::duration_cast<chrono::microseconds>(now -
+                                                          request.sent_at);
+    stats_.add(latency);
+    return true;
+  }
+
+  size_t in_flight() {
+    lock_guard<mutex> lock(mutex_);
+    return in_flight_.size();
+  }
+
+  LatencyStats stats() {
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+  }
+
+ private:
+  atomic<uint64_t> *id_counter_;
+  atomic<uint64_t> own_id_counter_;
+  mutex mutex_;
+  deque<InferenceRequest> in_flight_;
+  LatencyStats stats_;
+};
+
+// Releases results in request ID order, holding back the ones that complete
+// before an older request.
+template <typename T>
+class ReorderBuffer {
+ public:
+  typedef function<void(uint64_t, T)> Callback;
+
+  explicit ReorderBuffer(uint64_t first_id = 0) : next_id_(first_id) {}
+
+  // Add the result of a request, and release every result that is now in
+  // order to `callback`
+  void push(uint64_t id, T result, const Callback &callback) {
+    lock_guard<mutex> lock(mutex_);
+    pending_.emplace(id, move(result));
+    release(callback);
+  }
+
+  // Skip a request that will never complete, e.g. dropped or failed
+  void skip(uint64_t id, const Callback &callback) {
+    lock_guard<mutex> lock(mutex_);
+    skipped_.insert(id);
+    release(callback);
+  }
+
+  size_t pending() {
+    lock_guard<mutex> lock(mutex_);
+    return pending_.size();
+  }
+
+  // Drop the pending results, and release from `first_id` on
+  void reset(uint64_t first_id) {
+    lock_guard<mutex> lock(mutex_);
+    pending_.clear();
+    skipped_.clear();
+    next_id_ = first_id;
+  }
+
+ private:
+  void release(const Callback &callback) {
+    while (true) {
+      auto it = pending_.find(next_id_);
+      if (it != pending_.end()) {
+        callback(it->first, move(it->second));
+        pending_.erase(it);
+      } else if (!skipped_.erase(next_id_)) {
+        return;
+      }
+      next_id_++;
+    }
+  }
+
+  mutex mutex_;
+  uint64_t next_id_;
+  map<uint64_t, T> pending_;
+  set<uint64_t> skipped_;
+};
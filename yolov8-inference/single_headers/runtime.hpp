@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#include <dlfcn.h>
+#endif
+
 typedef struct Runtime {
     int (*runtime_initialization)();
     int (*runtime_initialization_with_args)(int, const char **, const void **);
@@ -9,15 +13,44 @@ typedef struct Runtime {
     const char *(*runtime_version)();
     const char *(*runtime_name)();
 
+    // Allocator of the runtime, which frees the inputs it is sent and
+    // allocates the outputs it returns. An isolated instance has a C library,
+    // hence a heap, of its own.
+    void *(*allocate)(size_t);
+    void (*deallocate)(void *);
+    bool isolated;  // Loaded in a link-map namespace of its own
+
     // Internal fields
     void *handle;  // Handle to the loaded library
 } Runtime;
 
-Runtime *load_runtime_library(const string &library_path) {
+// Load a new copy of the library in its own link-map namespace, with its own
+// globals and its own copies of the libraries it depends on.
+// Returns nullptr if dlmopen is not available.
+void *load_isolated_library(const string &library_path) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    void *handle =
+        dlmopen(LM_ID_NEWLM, library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        spdlog::error("dlmopen failed: {}", dlerror());
+    }
+    return handle;
+#else
+    spdlog::error("Isolated runtime instances require dlmopen (glibc).");
+    return nullptr;
+#endif
+}
+
+// Load the runtime library and its interface symbols.
+// With `isolated`, the library is loaded in a new namespace so that several
+// instances of the same runtime can coexist in the process.
+Runtime *load_runtime_library(const string &library_path,
+                              bool isolated = false) {
     void *handle = nullptr;
     try {
         // Load the runtime library using the custom loader
-        handle = load_dynamic_library(library_path.c_str());
+        handle = isolated ? load_isolated_library(library_path)
+                          : load_dynamic_library(library_path.c_str());
         // Load runtime interface symbols
         if (!handle) {
             throw std::runtime_error("Failed to load library: " + library_path);
@@ -76,6 +109,22 @@ Runtime *load_runtime_library(const string &library_path) {
         if (!runtime->runtime_name) {
             throw std::runtime_error("Failed to load symbol: runtime_name");
         }
+        // Tensors handed over to or by an isolated instance live in the heap
+        // of its own C library
+        if (isolated) {
+            runtime->allocate = reinterpret_cast<void *(*)(size_t)>(
+                get_symbol_address(handle, "malloc"));
+            runtime->deallocate = reinterpret_cast<void (*)(void *)>(
+                get_symbol_address(handle, "free"));
+            if (!runtime->allocate || !runtime->deallocate) {
+                throw std::runtime_error(
+                    "Failed to load symbols: malloc and free");
+            }
+        } else {
+            runtime->allocate = std::malloc;
+            runtime->deallocate = std::free;
+        }
+        runtime->isolated = isolated;
         runtime->handle = handle;  // Store the handle in the Runtime struct
         return runtime;            // Return the initialized Runtime struct
     } catch (const std::exception &e) {
@@ -0,0 +1,74 @@
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Several instances of the same runtime, sharing the work.
+// The OAAX interface is process-global, so each instance beyond the first is
+// a copy of the library loaded in its own dlmopen namespace. Inputs go to the
+// instance with the fewest requests in flight, and outputs are collected from
+// all instances in turn.
+// Note that glibc supports at most 16 namespaces per process.
+class RuntimeGroup {
+ public:
+  RuntimeGroup(const string &library_path, size_t num_instances)
+      : in_flight_(new atomic<int>[num_instances]), next_to_poll_(0) {
+    for (size_t i = 0; i < num_instances; ++i) {
+      // A single instance is loaded like any other library
+      runtimes_.push_back(
+          load_runtime_library(library_path, num_instances > 1));
+      in_flight_[i] = 0;
+    }
+  }
+
+  ~RuntimeGroup() {
+    for (Runtime *runtime : runtimes_) {
+      destroy_runtime(runtime);
+    }
+  }
+
+  size_t size() const { return runtimes_.size(); }
+  Runtime *instance(size_t i) const { return runtimes_[i]; }
+
+  // Instance with the fewest requests in flight
+  size_t least_loaded() const {
+    size_t best = 0;
+    for (size_t i = 1; i < runtimes_.size(); ++i) {
+      if (in_flight_[i] < in_flight_[best]) {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  // Send the input tensors to the given instance, see Runtime::send_input
+  int send_input(size_t instance, tensors_struct *input_tensors) {
+    in_flight_[instance]++;
+    int exit_code = runtimes_[instance]->send_input(input_tensors);
+    if (exit_code != 0) {
+      in_flight_[instance]--;
+    }
+    return exit_code;
+  }
+
+  // Receive an output from any instance, polling them in turn, and set
+  // `instance` to the one it came from. See Runtime::receive_output.
+  int receive_output(tensors_struct **output_tensors, size_t &instance) {
+    const size_t count = runtimes_.size();
+    for (size_t k = 0; k < count; ++k) {
+      size_t i = (next_to_poll_ + k) % count;
+      if (runtimes_[i]->receive_output(output_tensors) == 0) {
+        in_flight_[i]--;
+        // Start with the next instance, to be fair across instances
+        next_to_poll_ = (i + 1) % count;
+        instance = i;
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+ private:
+  vector<Runtime *> runtimes_;
+  unique_ptr<atomic<int>[]> in_flight_;
+  size_t next_to_poll_;  // Only used by the receiving thread
+};
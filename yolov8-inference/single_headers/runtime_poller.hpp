@@ -0,0 +1,108 @@
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// Adaptive wait between two polls of the runtime.
+// It first spins, which catches outputs that are about to be ready, then
+// yields the core, then sleeps with an exponential backoff up to a cap, so an
+// idle runtime does not burn a core. `reset` starts over after a success.
+class BackoffWaiter {
+ public:
+  BackoffWaiter(int spin_polls = 100, int yield_polls = 100,
+                chrono::microseconds min_sleep = chrono::microseconds(10),
+                chrono::microseconds max_sleep = chrono::microseconds(500))
+      : spin_polls_(spin_polls),
+        yield_polls_(yield_polls),
+        min_sleep_(min_sleep),
+        max_sleep_(max_sleep) {
+    reset();
+  }
+
+  void reset() {
+    polls_ = 0;
+    sleep_ = min_sleep_;
+  }
+
+  void wait() {
+    if (polls_ < spin_polls_) {
+      cpu_relax();
+    } else if (polls_ < spin_polls_ + yield_polls_) {
+      this_thread::yield();
+    } else {
+      this_thread::sleep_for(sleep_);
+      sleep_ = min(sleep_ * 2, max_sleep_);
+    }
+    polls_++;
+  }
+
+ private:
+  static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+  }
+
+  const int spin_polls_;
+  const int yield_polls_;
+  const chrono::microseconds min_sleep_;
+  const chrono::microseconds max_sleep_;
+  int polls_;
+  chrono::microseconds sleep_;
+};
+
+// Polls `receive_output` of a runtime group with a BackoffWaiter, and hands
+// the outputs either to the caller or to a callback.
+class OutputPoller {
+ public:
+  // Called with every received output, whose ownership it takes, and the
+  // instance of the group it came from
+  typedef function<void(tensors_struct *, size_t)> Callback;
+
+  explicit OutputPoller(RuntimeGroup *runtimes,
+                        const BackoffWaiter &waiter = BackoffWaiter())
+      : runtimes_(runtimes), waiter_(waiter) {}
+
+  // Wait for the next output, for at most `timeout`, and set `instance` to
+  // the runtime instance it came from.
+  // Returns nullptr on timeout or when `stop` is set.
+  tensors_struct *receive(chrono::milliseconds timeout, size_t &instance,
+                          const atomic<bool> *stop = nullptr) {
+    const auto deadline = chrono::steady_clock::now() + timeout;
+    waiter_.reset();
+    while (true) {
+      tensors_struct *output_tensors = nullptr;
+      if (runtimes_->receive_output(&output_tensors, instance) == 0) {
+        return output_tensors;
+      }
+      if ((stop && *stop) || chrono::steady_clock::now() >= deadline) {
+        return nullptr;
+      }
+      waiter_.wait();
+    }
+  }
+
+  // Deliver up to `count` outputs to `callback`, stopping early when no
+  // output arrives within `timeout` or when `stop` is set.
+  // Returns the number of outputs delivered.
+  int run(int count, const Callback &callback, chrono::milliseconds timeout,
+          const atomic<bool> *stop = nullptr) {
+    int received = 0;
+    while (received < count) {
+      size_t instance = 0;
+      tensors_struct *output_tensors = receive(timeout, instance, stop);
+      if (!output_tensors) {
+        break;
+      }
+      received++;
+      callback(output_tensors, instance);
+    }
+    return received;
+  }
+
+ private:
+  RuntimeGroup *runtimes_;
+  BackoffWaiter waiter_;
+};
@@ -0,0 +1,836 @@
+// Vectorized HWC -> CHW deinterleave kernels of the preprocessing, and score
+// and box kernels of the postprocessing further down.
+// Every deinterleave kernel reads `n` interleaved 3-channel pixels from `src`
+// and writes channel k of each pixel to plane k. Callers that need a channel
+// swap (e.g. BGR -> RGB) simply pass the planes in swapped order.
+// The best implementation for the host CPU is selected once at runtime:
+// AVX2 or SSSE3 (SSE2 for the scores and boxes) on x86_64, NEON on aarch64,
+// and a scalar fallback otherwise.
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OAAX_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define OAAX_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Planar u8 -> f32 with per-plane `x * scale + bias`
+typedef void (*deinterleave_u8_to_f32_fn)(const uint8_t *src, size_t n,
+                                          const float scale[3],
+                                          const float bias[3], float *p0,
+                                          float *p1, float *p2);
+// Planar u8 -> u8 copy
+typedef void (*deinterleave_u8_to_u8_fn)(const uint8_t *src, size_t n,
+                                         uint8_t *p0, uint8_t *p1,
+                                         uint8_t *p2);
+// Planar u8 -> i8 with saturation to [0, 127]
+typedef void (*deinterleave_u8_to_i8_fn)(const uint8_t *src, size_t n,
+                                         int8_t *p0, int8_t *p1, int8_t *p2);
+
+struct DeinterleaveKernels {
+  const char *name;
+  deinterleave_u8_to_f32_fn u8_to_f32;
+  deinterleave_u8_to_u8_fn u8_to_u8;
+  deinterleave_u8_to_i8_fn u8_to_i8;
+};
+
+// Scalar fallback, also used for the tail of the vectorized kernels
+inline void deinterleave_u8_to_f32_scalar(const uint8_t *src, size_t n,
+                                          const float scale[3],
+                                          const float bias[3], float *p0,
+                                          float *p1, float *p2) {
+  for (size_t i = 0; i < n; ++i, src += 3) {
+    p0[i] = src[0] * scale[0] + bias[0];
+    p1[i] = src[1] * scale[1] + bias[1];
+    p2[i] = src[2] * scale[2] + bias[2];
+  }
+}
+
+inline void deinterleave_u8_to_u8_scalar(const uint8_t *src, size_t n,
+                                         uint8_t *p0, uint8_t *p1,
+                                         uint8_t *p2) {
+  for (size_t i = 0; i < n; ++i, src += 3) {
+    p0[i] = src[0];
+    p1[i] = src[1];
+    p2[i] = src[2];
+  }
+}
+
+inline void deinterleave_u8_to_i8_scalar(const uint8_t *src, size_t n,
+                                         int8_t *p0, int8_t *p1, int8_t *p2) {
+  for (size_t i = 0; i < n; ++i, src += 3) {
+    p0[i] = static_cast<int8_t>(src[0] > 127 ? 127 : src[0]);
+    p1[i] = static_cast<int8_t>(src[1] > 127 ? 127 : src[1]);
+    p2[i] = static_cast<int8_t>(src[2] > 127 ? 127 : src[2]);
+  }
+}
+
+#if defined(OAAX_SIMD_X86)
+// pshufb masks gathering channel 0, 1 and 2 of 16 pixels spread over three
+// 16-byte registers (a: bytes 0-15, b: bytes 16-31, c: bytes 32-47).
+// -1 entries zero the byte so the three partial results can be OR-ed.
+#define OAAX_DEINTERLEAVE_MASKS(set)                                          \
+  const auto m0a = set(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 15, 12, 9, 6,  \
+                       3, 0);                                                 \
+  const auto m0b = set(-1, -1, -1, -1, -1, 14, 11, 8, 5, 2, -1, -1, -1, -1,   \
+                       -1, -1);                                               \
+  const auto m0c = set(13, 10, 7, 4, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1,   \
+                       -1, -1);                                               \
+  const auto m1a = set(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 13, 10,    \
+                       7, 4, 1);                                              \
+  const auto m1b = set(-1, -1, -1, -1, -1, 15, 12, 9, 6, 3, 0, -1, -1, -1,    \
+                       -1, -1);                                               \
+  const auto m1c = set(14, 11, 8, 5, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1,   \
+                       -1, -1);                                               \
+  const auto m2a = set(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 14, 11,    \
+                       8, 5, 2);                                              \
+  const auto m2b = set(-1, -1, -1, -1, -1, -1, 13, 10, 7, 4, 1, -1, -1, -1,   \
+                       -1, -1);                                               \
+  const auto m2c = set(15, 12, 9, 6, 3, 0, -1, -1, -1, -1, -1, -1, -1, -1,    \
+                       -1, -1);
+
+// Same 16-byte mask in both 128-bit lanes
+#define OAAX_SET_EPI8_X2(...) \
+  _mm256_broadcastsi128_si256(_mm_set_epi8(__VA_ARGS__))
+
+#define OAAX_SHUFFLE3(shuffle, or_, a, b, c, ma, mb, mc) \
+  or_(or_(shuffle(a, ma), shuffle(b, mb)), shuffle(c, mc))
+
+__attribute__((target("ssse3"))) inline void deinterleave16_ssse3(
+    const uint8_t *src, __m128i &c0, __m128i &c1, __m128i &c2) {
+  OAAX_DEINTERLEAVE_MASKS(_mm_set_epi8)
+  const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+  const __m128i b =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+  const __m128i c =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+  c0 = OAAX_SHUFFLE3(_mm_shuffle_epi8, _mm_or_si128, a, b, c, m0a, m0b, m0c);
+  c1 = OAAX_SHUFFLE3(_mm_shuffle_epi8, _mm_or_si128, a, b, c, m1a, m1b, m1c);
+  c2 = OAAX_SHUFFLE3(_mm_shuffle_epi8, _mm_or_si128, a, b, c, m2a, m2b, m2c);
+}
+
+// Convert 16 u8 values to float, apply x * scale + bias and store them
+__attribute__((target("ssse3"))) inline void store16_f32_ssse3(
+    __m128i v, __m128 scale, __m128 bias, float *dst) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lo = _mm_unpacklo_epi8(v, zero);
+  const __m128i hi = _mm_unpackhi_epi8(v, zero);
+  const __m128i q[4] = {_mm_unpacklo_epi16(lo, zero),
+                        _mm_unpackhi_epi16(lo, zero),
+                        _mm_unpacklo_epi16(hi, zero),
+                        _mm_unpackhi_epi16(hi, zero)};
+  for (int k = 0; k < 4; ++k) {
+    const __m128 f = _mm_cvtepi32_ps(q[k]);
+    _mm_storeu_ps(dst + 4 * k, _mm_add_ps(_mm_mul_ps(f, scale), bias));
+  }
+}
+
+__attribute__((target("ssse3"))) inline void deinterleave_u8_to_f32_ssse3(
+    const uint8_t *src, size_t n, const float scale[3], const float bias[3],
+    float *p0, float *p1, float *p2) {
+  const __m128 s0 = _mm_set1_ps(scale[0]), b0 = _mm_set1_ps(bias[0]);
+  const __m128 s1 = _mm_set1_ps(scale[1]), b1 = _mm_set1_ps(bias[1]);
+  const __m128 s2 = _mm_set1_ps(scale[2]), b2 = _mm_set1_ps(bias[2]);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i c0, c1, c2;
+    deinterleave16_ssse3(src + 3 * i, c0, c1, c2);
+    store16_f32_ssse3(c0, s0, b0, p0 + i);
+    store16_f32_ssse3(c1, s1, b1, p1 + i);
+    store16_f32_ssse3(c2, s2, b2, p2 + i);
+  }
+  deinterleave_u8_to_f32_scalar(src + 3 * i, n - i, scale, bias, p0 + i,
+                                p1 + i, p2 + i);
+}
+
+__attribute__((target("ssse3"))) inline void deinterleave_u8_to_u8_ssse3(
+    const uint8_t *src, size_t n, uint8_t *p0, uint8_t *p1, uint8_t *p2) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i c0, c1, c2;
+    deinterleave16_ssse3(src + 3 * i, c0, c1, c2);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p0 + i), c0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p1 + i), c1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p2 + i), c2);
+  }
+  deinterleave_u8_to_u8_scalar(src + 3 * i, n - i, p0 + i, p1 + i, p2 + i);
+}
+
+__attribute__((target("ssse3"))) inline void deinterleave_u8_to_i8_ssse3(
+    const uint8_t *src, size_t n, int8_t *p0, int8_t *p1, int8_t *p2) {
+  const __m128i max_value = _mm_set1_epi8(127);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i c0, c1, c2;
+    deinterleave16_ssse3(src + 3 * i, c0, c1, c2);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p0 + i),
+                     _mm_min_epu8(c0, max_value));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p1 + i),
+                     _mm_min_epu8(c1, max_value));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p2 + i),
+                     _mm_min_epu8(c2, max_value));
+  }
+  deinterleave_u8_to_i8_scalar(src + 3 * i, n - i, p0 + i, p1 + i, p2 + i);
+}
+
+// AVX2 shuffles stay within 128-bit lanes, so each lane deinterleaves its own
+// group of 16 pixels: the low lane gets pixels 0-15, the high lane 16-31.
+__attribute__((target("avx2"))) inline void deinterleave32_avx2(
+    const uint8_t *src, __m256i &c0, __m256i &c1, __m256i &c2) {
+  OAAX_DEINTERLEAVE_MASKS(OAAX_SET_EPI8_X2)
+  const __m256i a = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 48)), 1);
+  const __m256i b = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 64)), 1);
+  const __m256i c = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32))),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 80)), 1);
+  c0 = OAAX_SHUFFLE3(_mm256_shuffle_epi8, _mm256_or_si256, a, b, c, m0a, m0b,
+                     m0c);
+  c1 = OAAX_SHUFFLE3(_mm256_shuffle_epi8, _mm256_or_si256, a, b, c, m1a, m1b,
+                     m1c);
+  c2 = OAAX_SHUFFLE3(_mm256_shuffle_epi8, _mm256_or_si256, a, b, c, m2a, m2b,
+                     m2c);
+}
+
+// Convert 32 u8 values to float, apply x * scale + bias and store them
+__attribute__((target("avx2"))) inline void store32_f32_avx2(__m256i v,
+                                                             __m256 scale,
+                                                             __m256 bias,
+                                                             float *dst) {
+  const __m128i halves[2] = {_mm256_castsi256_si128(v),
+                             _mm256_extracti128_si256(v, 1)};
+  for (int h = 0; h < 2; ++h) {
+    const __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(halves[h]));
+    const __m256 hi = _mm256_cvtepi32_ps(
+        _mm256_cvtepu8_epi32(_mm_srli_si128(halves[h], 8)));
+    _mm256_storeu_ps(dst + 16 * h,
+                     _mm256_add_ps(_mm256_mul_ps(lo, scale), bias));
+    _mm256_storeu_ps(dst + 16 * h + 8,
+                     _mm256_add_ps(_mm256_mul_ps(hi, scale), bias));
+  }
+}
+
+__attribute__((target("avx2"))) inline void deinterleave_u8_to_f32_avx2(
+    const uint8_t *src, size_t n, const float scale[3], const float bias[3],
+    float *p0, float *p1, float *p2) {
+  const __m256 s0 = _mm256_set1_ps(scale[0]), b0 = _mm256_set1_ps(bias[0]);
+  const __m256 s1 = _mm256_set1_ps(scale[1]), b1 = _mm256_set1_ps(bias[1]);
+  const __m256 s2 = _mm256_set1_ps(scale[2]), b2 = _mm256_set1_ps(bias[2]);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i c0, c1, c2;
+    deinterleave32_avx2(src + 3 * i, c0, c1, c2);
+    store32_f32_avx2(c0, s0, b0, p0 + i);
+    store32_f32_avx2(c1, s1, b1, p1 + i);
+    store32_f32_avx2(c2, s2, b2, p2 + i);
+  }
+  deinterleave_u8_to_f32_ssse3(src + 3 * i, n - i, scale, bias, p0 + i,
+                               p1 + i, p2 + i);
+}
+
+__attribute__((target("avx2"))) inline void deinterleave_u8_to_u8_avx2(
+    const uint8_t *src, size_t n, uint8_t *p0, uint8_t *p1, uint8_t *p2) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i c0, c1, c2;
+    deinterleave32_avx2(src + 3 * i, c0, c1, c2);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p0 + i), c0);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p1 + i), c1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p2 + i), c2);
+  }
+  deinterleave_u8_to_u8_ssse3(src + 3 * i, n - i, p0 + i, p1 + i, p2 + i);
+}
+
+__attribute__((target("avx2"))) inline void deinterleave_u8_to_i8_avx2(
+    const uint8_t *src, size_t n, int8_t *p0, int8_t *p1, int8_t *p2) {
+  const __m256i max_value = _mm256_set1_epi8(127);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i c0, c1, c2;
+    deinterleave32_avx2(src + 3 * i, c0, c1, c2);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p0 + i),
+                        _mm256_min_epu8(c0, max_value));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p1 + i),
+                        _mm256_min_epu8(c1, max_value));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p2 + i),
+                        _mm256_min_epu8(c2, max_value));
+  }
+  deinterleave_u8_to_i8_ssse3(src + 3 * i, n - i, p0 + i, p1 + i, p2 + i);
+}
+#endif  // OAAX_SIMD_X86
+
+#if defined(OAAX_SIMD_NEON)
+// Convert 16 u8 values to float, apply x * scale + bias and store them
+inline void store16_f32_neon(uint8x16_t v, float32x4_t scale,
+                             float32x4_t bias, float *dst) {
+  const uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+  const uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+  const uint32x4_t q[4] = {vmovl_u16(vget_low_u16(lo)),
+                           vmovl_u16(vget_high_u16(lo)),
+                           vmovl_u16(vget_low_u16(hi)),
+                           vmovl_u16(vget_high_u16(hi))};
+  for (int k = 0; k < 4; ++k) {
+    vst1q_f32(dst + 4 * k, vmlaq_f32(bias, vcvtq_f32_u32(q[k]), scale));
+  }
+}
+
+inline void deinterleave_u8_to_f32_neon(const uint8_t *src, size_t n,
+                                        const float scale[3],
+                                        const float bias[3], float *p0,
+                                        float *p1, float *p2) {
+  const float32x4_t s0 = vdupq_n_f32(scale[0]), b0 = vdupq_n_f32(bias[0]);
+  const float32x4_t s1 = vdupq_n_f32(scale[1]), b1 = vdupq_n_f32(bias[1]);
+  const float32x4_t s2 = vdupq_n_f32(scale[2]), b2 = vdupq_n_f32(bias[2]);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16x3_t v = vld3q_u8(src + 3 * i);
+    store16_f32_neon(v.val[0], s0, b0, p0 + i);
+    store16_f32_neon(v.val[1], s1, b1, p1 + i);
+    store16_f32_neon(v.val[2], s2, b2, p2 + i);
+  }
+  deinterleave_u8_to_f32_scalar(src + 3 * i, n - i, scale, bias, p0 + i,
+                                p1 + i, p2 + i);
+}
+
+inline void deinterleave_u8_to_u8_neon(const uint8_t *src, size_t n,
+                                       uint8_t *p0, uint8_t *p1,
+                                       uint8_t *p2) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16x3_t v = vld3q_u8(src + 3 * i);
+    vst1q_u8(p0 + i, v.val[0]);
+    vst1q_u8(p1 + i, v.val[1]);
+    vst1q_u8(p2 + i, v.val[2]);
+  }
+  deinterleave_u8_to_u8_scalar(src + 3 * i, n - i, p0 + i, p1 + i, p2 + i);
+}
+
+inline void deinterleave_u8_to_i8_neon(const uint8_t *src, size_t n,
+                                       int8_t *p0, int8_t *p1, int8_t *p2) {
+  const uint8x16_t max_value = vdupq_n_u8(127);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16x3_t v = vld3q_u8(src + 3 * i);
+    vst1q_s8(p0 + i, vreinterpretq_s8_u8(vminq_u8(v.val[0], max_value)));
+    vst1q_s8(p1 + i, vreinterpretq_s8_u8(vminq_u8(v.val[1], max_value)));
+    vst1q_s8(p2 + i, vreinterpretq_s8_u8(vminq_u8(v.val[2], max_value)));
+  }
+  deinterleave_u8_to_i8_scalar(src + 3 * i, n - i, p0 + i, p1 + i, p2 + i);
+}
+#endif  // OAAX_SIMD_NEON
+
+// Pick the fastest kernels supported by the CPU. Resolved once per process.
+inline const DeinterleaveKernels &deinterleave_kernels() {
+  static const DeinterleaveKernels kernels = []() -> DeinterleaveKernels {
+#if defined(OAAX_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return DeinterleaveKernels{"avx2", deinterleave_u8_to_f32_avx2,
+                                 deinterleave_u8_to_u8_avx2,
+                                 deinterleave_u8_to_i8_avx2};
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+      return DeinterleaveKernels{"ssse3", deinterleave_u8_to_f32_ssse3,
+                                 deinterleave_u8_to_u8_ssse3,
+                                 deinterleave_u8_to_i8_ssse3};
+    }
+#elif defined(OAAX_SIMD_NEON)
+    return DeinterleaveKernels{"neon", deinterleave_u8_to_f32_neon,
+                               deinterleave_u8_to_u8_neon,
+                               deinterleave_u8_to_i8_neon};
+#endif
+    return DeinterleaveKernels{"scalar", deinterleave_u8_to_f32_scalar,
+                               deinterleave_u8_to_u8_scalar,
+                               deinterleave_u8_to_i8_scalar};
+  }();
+  return kernels;
+}
+
+// Score kernels of the postprocessing, over channel-major outputs where the
+// scores of consecutive anchors are contiguous, so that one vector holds
+// the same class of several anchors.
+
+// Per-anchor maximum over `num_classes` rows of `n` scores, `stride` floats
+// apart, and the class it belongs to. Ties go to the lowest class.
+typedef void (*max_score_f32_fn)(const float *scores, size_t num_classes,
+                                 size_t stride, size_t n, float *max_score,
+                                 int32_t *max_class);
+// Write the indices of the `n` values above `threshold` to `indices`, in
+// increasing order, and return their number
+typedef size_t (*select_above_f32_fn)(const float *values, size_t n,
+                                      float threshold, uint32_t *indices);
+// Quantized scores, as 8-bit codes XOR-ed with `flip`: 0x80 maps int8 codes
+// to uint8 ones of the same order, 0 keeps uint8 codes as they are.
+// Per-anchor maximum code over `num_classes` rows of `n` codes, `stride`
+// bytes apart
+typedef void (*max_code_u8_fn)(const uint8_t *scores, size_t num_classes,
+                               size_t stride, size_t n, uint8_t flip,
+                               uint8_t *max_code);
+// Write the indices of the `n` codes of at least `threshold` to `indices`, in
+// increasing order, and return their number
+typedef size_t (*select_at_least_u8_fn)(const uint8_t *codes, size_t n,
+                                        uint8_t threshold, uint32_t *indices);
+
+struct ScoreKernels {
+  const char *name;
+  max_score_f32_fn max_score;
+  select_above_f32_fn select_above;
+  max_code_u8_fn max_code;
+  select_at_least_u8_fn select_at_least;
+};
+
+inline void max_score_f32_scalar(const float *scores, size_t num_classes,
+                                 size_t stride, size_t n, float *max_score,
+                                 int32_t *max_class) {
+  for (size_t i = 0; i < n; ++i) {
+    float best = scores[i];
+    int32_t best_class = 0;
+    for (size_t c = 1; c < num_classes; ++c) {
+      const float score = scores[c * stride + i];
+      if (score > best) {
+        best = score;
+        best_class = static_cast<int32_t>(c);
+      }
+    }
+    max_score[i] = best;
+    max_class[i] = best_class;
+  }
+}
+
+inline size_t select_above_f32_scalar(const float *values, size_t n,
+                                      float threshold, uint32_t *indices) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (values[i] > threshold) {
+      indices[count++] = static_cast<uint32_t>(i);
+    }
+  }
+  return count;
+}
+
+inline void max_code_u8_scalar(const uint8_t *scores, size_t num_classes,
+                               size_t stride, size_t n, uint8_t flip,
+                               uint8_t *max_code) {
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t best = scores[i] ^ flip;
+    for (size_t c = 1; c < num_classes; ++c) {
+      best = max<uint8_t>(best, scores[c * stride + i] ^ flip);
+    }
+    max_code[i] = best;
+  }
+}
+
+inline size_t select_at_least_u8_scalar(const uint8_t *codes, size_t n,
+                                        uint8_t threshold,
+                                        uint32_t *indices) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (codes[i] >= threshold) {
+      indices[count++] = static_cast<uint32_t>(i);
+    }
+  }
+  return count;
+}
+
+#if defined(OAAX_SIMD_X86)
+// Without blendv, which SSE2 lacks
+__attribute__((target("sse2"))) inline void max_score_f32_sse2(
+    const float *scores, size_t num_classes, size_t stride, size_t n,
+    float *max_score, int32_t *max_class) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 best = _mm_loadu_ps(scores + i);
+    __m128i best_class = _mm_setzero_si128();
+    for (size_t c = 1; c < num_classes; ++c) {
+      const __m128 score = _mm_loadu_ps(scores + c * stride + i);
+      const __m128 greater = _mm_cmpgt_ps(score, best);
+      const __m128i mask = _mm_castps_si128(greater);
+      best = _mm_or_ps(_mm_and_ps(greater, score),
+                       _mm_andnot_ps(greater, best));
+      best_class = _mm_or_si128(
+          _mm_and_si128(mask, _mm_set1_epi32(static_cast<int32_t>(c))),
+          _mm_andnot_si128(mask, best_class));
+    }
+    _mm_storeu_ps(max_score + i, best);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(max_class + i), best_class);
+  }
+  max_score_f32_scalar(scores + i, num_classes, stride, n - i, max_score + i,
+                       max_class + i);
+}
+
+__attribute__((target("sse2"))) inline size_t select_above_f32_sse2(
+    const float *values, size_t n, float threshold, uint32_t *indices) {
+  const __m128 limit = _mm_set1_ps(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    unsigned mask = static_cast<unsigned>(
+        _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(values + i), limit)));
+    while (mask) {
+      indices[count++] = static_cast<uint32_t>(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  const size_t vectorized = count;
+  count += select_above_f32_scalar(values + i, n - i, threshold,
+                                   indices + count);
+  for (size_t k = vectorized; k < count; ++k) {
+    indices[k] += static_cast<uint32_t>(i);
+  }
+  return count;
+}
+
+// 16 anchors per vector, with an unsigned maximum and no class to track
+__attribute__((target("sse2"))) inline void max_code_u8_sse2(
+    const uint8_t *scores, size_t num_classes, size_t stride, size_t n,
+    uint8_t flip, uint8_t *max_code) {
+  const __m128i flip16 = _mm_set1_epi8(static_cast<char>(flip));
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i best = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(scores + i)),
+        flip16);
+    for (size_t c = 1; c < num_classes; ++c) {
+      const __m128i code = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(scores + c * stride + i));
+      best = _mm_max_epu8(best, _mm_xor_si128(code, flip16));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(max_code + i), best);
+  }
+  max_code_u8_scalar(scores + i, num_classes, stride, n - i, flip,
+                     max_code + i);
+}
+
+__attribute__((target("sse2"))) inline size_t select_at_least_u8_sse2(
+    const uint8_t *codes, size_t n, uint8_t threshold, uint32_t *indices) {
+  const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // Without an unsigned compare: code >= limit if max(code, limit) == code
+    const __m128i code =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(codes + i));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_max_epu8(code, limit), code)));
+    while (mask) {
+      indices[count++] = static_cast<uint32_t>(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  const size_t vectorized = count;
+  count += select_at_least_u8_scalar(codes + i, n - i, threshold,
+                                     indices + count);
+  for (size_t k = vectorized; k < count; ++k) {
+    indices[k] += static_cast<uint32_t>(i);
+  }
+  return count;
+}
+
+// 16 anchors at a time, a cache line of every row, with two independent
+// compare and blend chains
+__attribute__((target("avx2"))) inline void max_score_f32_avx2(
+    const float *scores, size_t num_classes, size_t stride, size_t n,
+    float *max_score, int32_t *max_class) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256 best0 = _mm256_loadu_ps(scores + i);
+    __m256 best1 = _mm256_loadu_ps(scores + i + 8);
+    __m256i best_class0 = _mm256_setzero_si256();
+    __m256i best_class1 = _mm256_setzero_si256();
+    for (size_t c = 1; c < num_classes; ++c) {
+      const float *row = scores + c * stride + i;
+      const __m256i label = _mm256_set1_epi32(static_cast<int32_t>(c));
+      const __m256 score0 = _mm256_loadu_ps(row);
+      const __m256 score1 = _mm256_loadu_ps(row + 8);
+      const __m256 greater0 = _mm256_cmp_ps(score0, best0, _CMP_GT_OQ);
+      const __m256 greater1 = _mm256_cmp_ps(score1, best1, _CMP_GT_OQ);
+      best0 = _mm256_blendv_ps(best0, score0, greater0);
+      best1 = _mm256_blendv_ps(best1, score1, greater1);
+      best_class0 = _mm256_blendv_epi8(best_class0, label,
+                                       _mm256_castps_si256(greater0));
+      best_class1 = _mm256_blendv_epi8(best_class1, label,
+                                       _mm256_castps_si256(greater1));
+    }
+    _mm256_storeu_ps(max_score + i, best0);
+    _mm256_storeu_ps(max_score + i + 8, best1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(max_class + i),
+                        best_class0);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(max_class + i + 8),
+                        best_class1);
+  }
+  max_score_f32_scalar(scores + i, num_classes, stride, n - i, max_score + i,
+                       max_class + i);
+}
+
+__attribute__((target("avx2"))) inline size_t select_above_f32_avx2(
+    const float *values, size_t n, float threshold, uint32_t *indices) {
+  const __m256 limit = _mm256_set1_ps(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(values + i), limit, _CMP_GT_OQ)));
+    while (mask) {
+      indices[count++] = static_cast<uint32_t>(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  const size_t vectorized = count;
+  count += select_above_f32_scalar(values + i, n - i, threshold,
+                                   indices + count);
+  for (size_t k = vectorized; k < count; ++k) {
+    indices[k] += static_cast<uint32_t>(i);
+  }
+  return count;
+}
+
+__attribute__((target("avx2"))) inline void max_code_u8_avx2(
+    const uint8_t *scores, size_t num_classes, size_t stride, size_t n,
+    uint8_t flip, uint8_t *max_code) {
+  const __m256i flip32 = _mm256_set1_epi8(static_cast<char>(flip));
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i best = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(scores + i)),
+        flip32);
+    for (size_t c = 1; c < num_classes; ++c) {
+      const __m256i code = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(scores + c * stride + i));
+      best = _mm256_max_epu8(best, _mm256_xor_si256(code, flip32));
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(max_code + i), best);
+  }
+  max_code_u8_sse2(scores + i, num_classes, stride, n - i, flip,
+                   max_code + i);
+}
+
+__attribute__((target("avx2"))) inline size_t select_at_least_u8_avx2(
+    const uint8_t *codes, size_t n, uint8_t threshold, uint32_t *indices) {
+  const __m256i limit = _mm256_set1_epi8(static_cast<char>(threshold));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i code =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(codes + i));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(code, limit), code)));
+    while (mask) {
+      indices[count++] = static_cast<uint32_t>(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  const size_t vectorized = count;
+  count += select_at_least_u8_scalar(codes + i, n - i, threshold,
+                                     indices + count);
+  for (size_t k = vectorized; k < count; ++k) {
+    indices[k] += static_cast<uint32_t>(i);
+  }
+  return count;
+}
+#endif  // OAAX_SIMD_X86
+
+#if defined(OAAX_SIMD_NEON)
+inline void max_score_f32_neon(const float *scores, size_t num_classes,
+                               size_t stride, size_t n, float *max_score,
+                               int32_t *max_class) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t best = vld1q_f32(scores + i);
+    int32x4_t best_class = vdupq_n_s32(0);
+    for (size_t c = 1; c < num_classes; ++c) {
+      const float32x4_t score = vld1q_f32(scores + c * stride + i);
+      const uint32x4_t greater = vcgtq_f32(score, best);
+      best = vbslq_f32(greater, score, best);
+      best_class = vbslq_s32(greater, vdupq_n_s32(static_cast<int32_t>(c)),
+                             best_class);
+    }
+    vst1q_f32(max_score + i, best);
+    vst1q_s32(max_class + i, best_class);
+  }
+  max_score_f32_scalar(scores + i, num_classes, stride, n - i, max_score + i,
+                       max_class + i);
+}
+
+inline size_t select_above_f32_neon(const float *values, size_t n,
+                                    float threshold, uint32_t *indices) {
+  const float32x4_t limit = vdupq_n_f32(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    // Most anchors are below the threshold, skip them four at a time
+    const uint32x4_t above = vcgtq_f32(vld1q_f32(values + i), limit);
+    const uint32x2_t any = vorr_u32(vget_low_u32(above), vget_high_u32(above));
+    if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) == 0) {
+      continue;
+    }
+    for (size_t k = i; k < i + 4; ++k) {
+      if (values[k] > threshold) {
+        indices[count++] = static_cast<uint32_t>(k);
+      }
+    }
+  }
+  const size_t vectorized = count;
+  count += select_above_f32_scalar(values + i, n - i, threshold,
+                                   indices + count);
+  for (size_t k = vectorized; k < count; ++k) {
+    indices[k] += static_cast<uint32_t>(i);
+  }
+  return count;
+}
+
+inline void max_code_u8_neon(const uint8_t *scores, size_t num_classes,
+                             size_t stride, size_t n, uint8_t flip,
+                             uint8_t *max_code) {
+  const uint8x16_t flip16 = vdupq_n_u8(flip);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t best = veorq_u8(vld1q_u8(scores + i), flip16);
+    for (size_t c = 1; c < num_classes; ++c) {
+      const uint8x16_t code = vld1q_u8(scores + c * stride + i);
+      best = vmaxq_u8(best, veorq_u8(code, flip16));
+    }
+    vst1q_u8(max_code + i, best);
+  }
+  max_code_u8_scalar(scores + i, num_classes, stride, n - i, flip,
+                     max_code + i);
+}
+
+inline size_t select_at_least_u8_neon(const uint8_t *codes, size_t n,
+                                      uint8_t threshold, uint32_t *indices) {
+  const uint8x16_t limit = vdupq_n_u8(threshold);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // Most anchors are below the threshold, skip them sixteen at a time
+    const uint64x2_t passed =
+        vreinterpretq_u64_u8(vcgeq_u8(vld1q_u8(codes + i), limit));
+    if ((vgetq_lane_u64(passed, 0) | vgetq_lane_u64(passed, 1)) == 0) {
+      continue;
+    }
+    for (size_t k = i; k < i + 16; ++k) {
+      if (codes[k] >= threshold) {
+        indices[count++] = static_cast<uint32_t>(k);
+      }
+    }
+  }
+  const size_t vectorized = count;
+  count += select_at_least_u8_scalar(codes + i, n - i, threshold,
+                                     indices + count);
+  for (size_t k = vectorized; k < count; ++k) {
+    indices[k] += static_cast<uint32_t>(i);
+  }
+  return count;
+}
+#endif  // OAAX_SIMD_NEON
+
+// Pick the fastest score kernels supported by the CPU. Resolved once per
+// process.
+inline const ScoreKernels &score_kernels() {
+  static const ScoreKernels kernels = []() -> ScoreKernels {
+#if defined(OAAX_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return ScoreKernels{"avx2", max_score_f32_avx2, select_above_f32_avx2,
+                          max_code_u8_avx2, select_at_least_u8_avx2};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      return ScoreKernels{"sse2", max_score_f32_sse2, select_above_f32_sse2,
+                          max_code_u8_sse2, select_at_least_u8_sse2};
+    }
+#elif defined(OAAX_SIMD_NEON)
+    return ScoreKernels{"neon", max_score_f32_neon, select_above_f32_neon,
+                        max_code_u8_neon, select_at_least_u8_neon};
+#endif
+    return ScoreKernels{"scalar", max_score_f32_scalar,
+                        select_above_f32_scalar, max_code_u8_scalar,
+                        select_at_least_u8_scalar};
+  }();
+  return kernels;
+}
+
+// Box kernel of the postprocessing, mapping the corners of detections from
+// the model input back to the source image. The four coordinates of a box
+// are contiguous, so one vector maps a whole box.
+
+// Map `n` boxes of 4 floats, `stride` floats apart, in place: every
+// coordinate k becomes min(max(box[k] * scale[k] + bias[k], low[k]), high[k])
+typedef void (*map_boxes_f32_fn)(float *boxes, size_t n, size_t stride,
+                                 const float *scale, const float *bias,
+                                 const float *low, const float *high);
+
+struct BoxKernels {
+  const char *name;
+  map_boxes_f32_fn map_boxes;
+};
+
+inline void map_boxes_f32_scalar(float *boxes, size_t n, size_t stride,
+                                 const float *scale, const float *bias,
+                                 const float *low, const float *high) {
+  for (size_t i = 0; i < n; ++i) {
+    float *box = boxes + i * stride;
+    for (int k = 0; k < 4; ++k) {
+      const float value = box[k] * scale[k] + bias[k];
+      const float above_low = value > low[k] ? value : low[k];
+      box[k] = above_low < high[k] ? above_low : high[k];
+    }
+  }
+}
+
+#if defined(OAAX_SIMD_X86)
+__attribute__((target("sse2"))) inline void map_boxes_f32_sse2(
+    float *boxes, size_t n, size_t stride, const float *scale,
+    const float *bias, const float *low, const float *high) {
+  const __m128 scale4 = _mm_loadu_ps(scale);
+  const __m128 bias4 = _mm_loadu_ps(bias);
+  const __m128 low4 = _mm_loadu_ps(low);
+  const __m128 high4 = _mm_loadu_ps(high);
+  for (size_t i = 0; i < n; ++i) {
+    float *box = boxes + i * stride;
+    const __m128 value =
+        _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(box), scale4), bias4);
+    _mm_storeu_ps(box, _mm_min_ps(_mm_max_ps(value, low4), high4));
+  }
+}
+#endif  // OAAX_SIMD_X86
+
+#if defined(OAAX_SIMD_NEON)
+inline void map_boxes_f32_neon(float *boxes, size_t n, size_t stride,
+                               const float *scale, const float *bias,
+                               const float *low, const float *high) {
+  const float32x4_t scale4 = vld1q_f32(scale);
+  const float32x4_t bias4 = vld1q_f32(bias);
+  const float32x4_t low4 = vld1q_f32(low);
+  const float32x4_t high4 = vld1q_f32(high);
+  for (size_t i = 0; i < n; ++i) {
+    float *box = boxes + i * stride;
+    const float32x4_t value = vmlaq_f32(bias4, vld1q_f32(box), scale4);
+    vst1q_f32(box, vminq_f32(vmaxq_f32(value, low4), high4));
+  }
+}
+#endif  // OAAX_SIMD_NEON
+
+// Pick the fastest box kernel supported by the CPU. Resolved once per
+// process.
+inline const BoxKernels &box_kernels() {
+  static const BoxKernels kernels = []() -> BoxKernels {
+#if defined(OAAX_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      return BoxKernels{"sse2", map_boxes_f32_sse2};
+    }
+#elif defined(OAAX_SIMD_NEON)
+    return BoxKernels{"neon", map_boxes_f32_neon};
+#endif
+    return BoxKernels{"scalar", map_boxes_f32_scalar};
+  }();
+  return kernels;
+}
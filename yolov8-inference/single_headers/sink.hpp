@@ -0,0 +1,287 @@
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+// Output of the detections, from the optional "sink" object of the JSON
+// config. Nothing is written without a path.
+struct SinkConfig {
+  // File the records are appended to
+  string path;
+  // "jsonl" for one JSON object per line, or "binary", see ResultSink
+  string format = "jsonl";
+  // Input stream the frames come from, copied into every record
+  uint32_t source_id = 0;
+  // Formatted records gathered into one write
+  size_t buffer_bytes = 1 << 20;
+  // Time between two syncs of the file to the disk, 0 to leave it to the OS
+  chrono::milliseconds fsync_interval{0};
+};
+
+SinkConfig parse_sink_config(const nlohmann::json &config) {
+  SinkConfig sink;
+  if (!config.contains("sink")) {
+    return sink;
+  }
+  const nlohmann::json &section = config["sink"];
+  if (section.contains("path")) {
+    sink.path = section["path"].get<string>();
+  }
+  if (section.contains("format")) {
+    sink.format = section["format"].get<string>();
+  }
+  if (section.contains("source_id")) {
+    sink.source_id = section["source_id"].get<uint32_t>();
+  }
+  if (section.contains("buffer_kb")) {
+    sink.buffer_bytes = section["buffer_kb"].get<size_t>() * 1024;
+  }
+  if (section.contains("fsync_interval_ms")) {
+    sink.fsync_interval =
+        chrono::milliseconds(section["fsync_interval_ms"].get<int64_t>());
+  }
+  if ((sink.format != "jsonl" && sink.format != "binary") ||
+      sink.buffer_bytes < 1024 || sink.fsync_interval.count() < 0) {
+    spdlog::error(
+        "The sink requires a \"jsonl\" or \"binary\" format, buffer_kb >= 1 "
+        "and fsync_interval_ms >= 0.");
+    exit(EXIT_FAILURE);
+  }
+  return sink;
+}
+
+// Header of a binary results file, written once when the file is created
+constexpr char kBinaryResultsMagic[8] = {'O', 'A', 'A', 'X',
+                                         'D', 'E', 'T', '1'};
+
+template <typename T>
+void append_raw(string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Binary record of one frame, in host byte order:
+//   uint64 request_id, uint64 timestamp_us, uint32 source_id, uint32 frame,
+//   uint32 num_boxes, then per box
+//   float x1, y1, x2, y2, score, int32 class_id
+// Records follow each other without padding.
+void format_binary_record(const FrameResult &result, uint32_t source_id,
+                          uint64_t timestamp_us, string &out) {
+  static_assert(sizeof(Detection) == 5 * sizeof(float) + sizeof(int32_t),
+                "A detection must be stored as is in a binary record");
+  append_raw(out, static_cast<uint64_t>(result.request_id));
+  append_raw(out, timestamp_us);
+  append_raw(out, source_id);
+  append_raw(out, static_cast<uint32_t>(result.frame));
+  append_raw(out, static_cast<uint32_t>(result.detections.size()));
+  out.append(reinterpret_cast<const char *>(result.detections.data()),
+             result.detections.size() * sizeof(Detection));
+}
+
+template <typename T>
+void append_integer(string &out, T value) {
+  char digits[24];
+  const to_chars_result end = to_chars(digits, digits + sizeof(digits), value);
+  out.append(digits, end.ptr);
+}
+
+// A number with `precision` decimals, independent of the locale. JSON has no
+// NaN or infinity, they are written as null.
+void append_fixed(string &out, float value, int precision) {
+  if (!isfinite(value)) {
+    out += "null";
+    return;
+  }
+  char digits[64];
+  const to_chars_result end =
+      to_chars(digits, digits + sizeof(digits), value, chars_format::fixed,
+               precision);
+  out.append(digits, end.ptr);
+}
+
+// JSON Lines record of one frame, formatted straight into `out`:
+// {"request_id":0,"frame":0,"source_id":0,"timestamp_us":0,"detections":
+// [{"class_id":0,"score":0.9,"box":[x1,y1,x2,y2]}]}
+void format_json_record(const FrameResult &result, uint32_t source_id,
+                        uint64_t timestamp_us, string &out) {
+  out += "{\"request_id\":";
+  append_integer(out, result.request_id);
+  out += ",\"frame\":";
+  append_integer(out, result.frame);
+  out += ",\"source_id\":";
+  append_integer(out, source_id);
+  out += ",\"timestamp_us\":";
+  append_integer(out, timestamp_us);
+  out += ",\"detections\":[";
+  for (size_t i = 0; i < result.detections.size(); ++i) {
+    const Detection &detection = result.detections[i];
+    out += i == 0 ? "{\"class_id\":" : ",{\"class_id\":";
+    append_integer(out, detection.class_id);
+    out += ",\"score\":";
+    append_fixed(out, detection.score, 4);
+    out += ",\"box\":[";
+    append_fixed(out, detection.x1, 2);
+    out += ',';
+    append_fixed(out, detection.y1, 2);
+    out += ',';
+    append_fixed(out, detection.x2, 2);
+    out += ',';
+    append_fixed(out, detection.y2, 2);
+    out += "]}";
+  }
+  out += "]}\n";
+}
+
+// Appends the detections of every frame to a file, as JSON Lines or binary
+// records.
+// Records are formatted, without any JSON DOM, into a buffer that a
+// background thread writes out in large blocks, once full or at the latest
+// kMaxBufferAge after the previous write, while the next records fill a
+// second buffer. The callers only wait when the writer falls a whole buffer
+// behind.
+class ResultSink {
+ public:
+  explicit ResultSink(const SinkConfig &config)
+      : config_(config), binary_(config.format == "binary") {
+    file_ = fopen(config.path.c_str(), binary_ ? "ab" : "a");
+    if (!file_) {
+      spdlog::error("Failed to open the results file {}: {}", config.path,
+                    strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    // The buffers are written in whole blocks, no need for stdio's
+    setvbuf(file_, nullptr, _IONBF, 0);
+    fseek(file_, 0, SEEK_END);
+    if (binary_ && ftell(file_) == 0) {
+      pending_.append(kBinaryResultsMagic, sizeof(kBinaryResultsMagic));
+    }
+    pending_.reserve(config.buffer_bytes + config.buffer_bytes / 4);
+    writing_.reserve(config.buffer_bytes + config.buffer_bytes / 4);
+    writer_ = thread(&ResultSink::writer_routine, this);
+  }
+
+  ~ResultSink() { close(); }
+
+  // Queue the record of a frame. Safe to call from several threads.
+  void write(const FrameResult &result) {
+    const uint64_t timestamp_us = static_cast<uint64_t>(
+        chrono::duration_cast<chrono::microseconds>(
+            chrono::system_clock::now().time_since_epoch())
+            .count());
+    unique_lock<mutex> lock(mutex_);
+    room_.wait(lock, [this] {
+      return pending_.size() < config_.buffer_bytes || !busy_;
+    });
+    if (binary_) {
+      format_binary_record(result, config_.source_id, timestamp_us, pending_);
+    } else {
+      format_json_record(result, config_.source_id, timestamp_us, pending_);
+    }
+    records_++;
+    if (pending_.size() >= config_.buffer_bytes) {
+      lock.unlock();
+      full_.notify_one();
+    }
+  }
+
+  // Write the remaining records and close the file. Records written
+  // afterwards are lost.
+  void close() {
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (closing_) {
+        return;
+      }
+      closing_ = true;
+    }
+    full_.notify_one();
+    writer_.join();
+    if (config_.fsync_interval.count() > 0) {
+      sync();
+    }
+    fclose(file_);
+    spdlog::info("Results: {} record(s), {} bytes in {} write(s) to {}",
+                 records_, bytes_, writes_, config_.path);
+  }
+
+ private:
+  // Longest time a record waits in a buffer that does not fill up
+  static constexpr chrono::milliseconds kMaxBufferAge{100};
+
+  void writer_routine() {
+    auto synced_at = chrono::steady_clock::now();
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+      full_.wait_for(lock, kMaxBufferAge, [this] {
+        return closing_ || pending_.size() >= config_.buffer_bytes;
+      });
+      if (pending_.empty()) {
+        if (closing_) {
+          return;
+        }
+        continue;
+      }
+      // Let the callers fill the other buffer meanwhile
+      swap(pending_, writing_);
+      busy_ = true;
+      lock.unlock();
+      room_.notify_all();
+
+      if (fwrite(writing_.data(), 1, writing_.size(), file_) !=
+          writing_.size()) {
+        spdlog::error("Failed to write to the results file {}: {}",
+                      config_.path, strerror(errno));
+      } else {
+        bytes_ += writing_.size();
+        writes_++;
+      }
+      writing_.clear();
+      const auto now = chrono::steady_clock::now();
+      if (config_.fsync_interval.count() > 0 &&
+          now - synced_at >= config_.fsync_interval) {
+        sync();
+        synced_at = now;
+      }
+
+      lock.lock();
+      busy_ = false;
+      room_.notify_all();
+    }
+  }
+
+  // Flush the file to the disk
+  void sync() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (fsync(fileno(file_)) != 0) {
+      spdlog::warn("Failed to sync the results file {}: {}", config_.path,
+                   strerror(errno));
+    }
+#endif
+  }
+
+  const SinkConfig config_;
+  const bool binary_;
+  FILE *file_;
+  mutex mutex_;
+  condition_variable full_;  // Wakes the writer
+  condition_variable room_;  // Wakes the callers
+  string pending_;           // Records to write next
+  string writing_;           // Records being written, by the writer only
+  bool busy_ = false;
+  bool closing_ = false;
+  thread writer_;
+  uint64_t records_ = 0;
+  // Written by the writer only
+  uint64_t bytes_ = 0;
+  uint64_t writes_ = 0;
+};
@@ -0,0 +1,443 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue, lock-free (D. Vyukov's ring of
+// sequenced cells). Every cell holds a sequence number telling whether it is
+// ready to be written or read at a given position, so producers and
+// consumers only contend on their own position counter.
+// The blocking `push` and `pop` wait with a BackoffWaiter.
+template <typename T>
+class BoundedQueue {
+ public:
+  // The capacity is rounded up to a power of two
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(round_up_to_power_of_two(capacity)),
+        mask_(capacity_ - 1),
+        cells_(new Cell[capacity_]) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      cells_[i].sequence.store(i, memory_order_relaxed);
+    }
+  }
+
+  // Move `value` into the queue, unless it is full
+  bool try_push(T &value) {
+    size_t pos = enqueue_pos_.load(memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) -
+                      static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               memory_order_relaxed)) {
+          cell.value = move(value);
+          cell.sequence.store(pos + 1, memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // Full
+      } else {
+        pos = enqueue_pos_.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  // Move the oldest value out of the queue, unless it is empty
+  bool try_pop(T &value) {
+    size_t pos = dequeue_pos_.load(memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) -
+                      static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               memory_order_relaxed)) {
+          value = move(cell.value);
+          cell.sequence.store(pos + mask_ + 1, memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // Empty
+      } else {
+        pos = dequeue_pos_.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  // Wait for room and push `value`. Returns false if the queue was closed.
+  bool push(T value) {
+    BackoffWaiter waiter;
+    while (!try_push(value)) {
+      if (closed_) {
+        return false;
+      }
+      waiter.wait();
+    }
+    // Sample the occupancy as seen by the producers
+    fill_sum_.fetch_add(size(), memory_order_relaxed);
+    fill_samples_.fetch_add(1, memory_order_relaxed);
+    return true;
+  }
+
+  // Wait for the next value. Returns false once the queue is closed and
+  // drained.
+  bool pop(T &value) {
+    BackoffWaiter waiter;
+    while (!try_pop(value)) {
+      if (closed_) {
+        // Values pushed right before closing
+        return try_pop(value);
+      }
+      waiter.wait();
+    }
+    return true;
+  }
+
+  // No more values will be pushed. Must be called once every producer is
+  // done.
+  void close() { closed_ = true; }
+
+  // Number of queued values, approximate while values are pushed or popped
+  size_t size() const {
+    size_t enqueued = enqueue_pos_.load(memory_order_relaxed);
+    size_t dequeued = dequeue_pos_.load(memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // Average fraction of the capacity in use right after a push
+  double mean_fill() const {
+    uint64_t samples = fill_samples_.load(memory_order_relaxed);
+    if (samples == 0) {
+      return 0.0;
+    }
+    return static_cast<double>(fill_sum_.load(memory_order_relaxed)) /
+           samples / capacity_;
+  }
+
+ private:
+  struct Cell {
+    atomic<size_t> sequence;
+    T value;
+  };
+
+  static size_t round_up_to_power_of_two(size_t n) {
+    size_t capacity = 2;
+    while (capacity < n) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  const size_t capacity_;
+  const size_t mask_;
+  unique_ptr<Cell[]> cells_;
+  // Producers and consumers work on separate cache lines
+  alignas(64) atomic<size_t> enqueue_pos_{0};
+  alignas(64) atomic<size_t> dequeue_pos_{0};
+  alignas(64) atomic<bool> closed_{false};
+  atomic<uint64_t> fill_sum_{0};
+  atomic<uint64_t> fill_samples_{0};
+};
+
+// Worker counts and queue sizes of the stages, from the optional "pipeline"
+// object of the JSON config
+struct StageConfig {
+  int frames = 10;  // Number of frames to decode
+  // Time from the decoding of a frame to its output after which the frame is
+  // dropped, 0 for none
+  chrono::microseconds deadline{0};
+  int decode_workers = 1;
+  int preprocess_workers = 1;
+  int postprocess_workers = 1;
+  size_t queue_capacity = 8;  // Between any two stages
+};
+
+StageConfig parse_stage_config(const nlohmann::json &config) {
+  StageConfig stages;
+  if (!config.contains("pipeline")) {
+    return stages;
+  }
+  const nlohmann::json &section = config["pipeline"];
+  if (section.contains("frames")) {
+    stages.frames = section["frames"].get<int>();
+  }
+  if (section.contains("decode_workers")) {
+    stages.decode_workers = section["decode_workers"].get<int>();
+  }
+  if (section.contains("preprocess_workers")) {
+    stages.preprocess_workers = section["preprocess_workers"].get<int>();
+  }
+  if (section.contains("postprocess_workers")) {
+    stages.postprocess_workers = section["postprocess_workers"].get<int>();
+  }
+  if (section.contains("queue_capacity")) {
+    stages.queue_capacity = section["queue_capacity"].get<size_t>();
+  }
+  if (section.contains("deadline_us")) {
+    stages.deadline =
+        chrono::microseconds(section["deadline_us"].get<int64_t>());
+  }
+  if (stages.frames < 0 || stages.decode_workers < 1 ||
+      stages.preprocess_workers < 1 || stages.postprocess_workers < 1 ||
+      stages.queue_capacity < 1 || stages.deadline.count() < 0) {
+    spdlog::error(
+        "The pipeline requires frames >= 0, at least one worker per stage, "
+        "queue_capacity >= 1 and deadline_us >= 0.");
+    exit(EXIT_FAILURE);
+  }
+  return stages;
+}
+
+// Time spent working by the threads of a stage, excluding the time they wait
+// for their input or for room in their output queue
+class StageStats {
+ public:
+  StageStats(const char *name, int workers)
+      : name_(name), workers_(workers) {}
+
+  void add(chrono::steady_clock::duration busy) {
+    busy_ns_.fetch_add(
+        chrono::duration_cast<chrono::nanoseconds>(busy).count(),
+        memory_order_relaxed);
+    items_.fetch_add(1, memory_order_relaxed);
+  }
+
+  const char *name() const { return name_; }
+  int workers() const { return workers_; }
+  uint64_t items() const { return items_; }
+  // Fraction of `elapsed` its workers were busy, 1 for a saturated stage
+  double occupancy(chrono::steady_clock::duration elapsed) const {
+    double elapsed_ns = static_cast<double>(
+        chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    return elapsed_ns > 0 ? busy_ns_ / elapsed_ns / workers_ : 0.0;
+  }
+
+ private:
+  const char *name_;
+  const int workers_;
+  atomic<int64_t> busy_ns_{0};
+  atomic<uint64_t> items_{0};
+};
+
+// Result of one frame, handed from the postprocessing to the sink
+struct FrameResult {
+  uint64_t request_id = 0;
+  size_t frame = 0;  // Index in its request
+  FrameOutput output;
+  vector<Detection> detections;  // Found by the postprocessing
+};
+
+// Runs the inference of a stream of frames as a chain of stages,
+//   decode -> preprocess -> send -> receive -> postprocess -> sink
+// connected by bounded queues, so that decoding and preprocessing the next
+// frames overlap the inference of the current ones, and postprocessing
+// overlaps the next receive. Send and receive are the two threads of an
+// InferencePipeline, the other stages have their own worker threads.
+// Frames are preprocessed and postprocessed in parallel, so they may reach
+// the sink out of order.
+class StagedPipeline {
+ public:
+  // Decode frame `index` into an 8-bit image at the model resolution, and
+  // set `transform` to the geometry of its resizing.
+  // Returns false on failure, the frame is then skipped.
+  typedef function<bool(size_t index, cv::Mat &image,
+                        ImageTransform &transform)>
+      DecodeFunction;
+  // Build the input tensors of an image, or return nullptr on failure
+  typedef function<tensors_struct *(const cv::Mat &image)> PreprocessFunction;
+  typedef function<void(FrameResult &result)> PostprocessFunction;
+  typedef function<void(const FrameResult &result)> SinkFunction;
+
+  StagedPipeline(InferencePipeline *inference, const StageConfig &config,
+                 DecodeFunction decode, PreprocessFunction preprocess,
+                 PostprocessFunction postprocess, SinkFunction sink)
+      : inference_(inference),
+        config_(config),
+        decode_(move(decode)),
+        preprocess_(move(preprocess)),
+        postprocess_(move(postprocess)),
+        sink_(move(sink)),
+        decoded_(config.queue_capacity),
+        preprocessed_(config.queue_capacity),
+        received_(config.queue_capacity),
+        postprocessed_(config.queue_capacity),
+        decode_stats_("decode", config.decode_workers),
+        preprocess_stats_("preprocess", config.preprocess_workers),
+        postprocess_stats_("postprocess", config.postprocess_workers),
+        sink_stats_("sink", 1) {}
+
+  // Push config.frames frames through every stage. Returns true if all of
+  // them made it to the sink.
+  bool run() {
+    const auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    atomic<size_t> next_index(0);
+    const AffinityPlan &affinity = inference_->affinity();
+    start_workers(config_.decode_workers, &decoded_, affinity.decode, threads,
+                  [this, &next_index] {
+                    for (size_t index = next_index++;
+                         index < static_cast<size_t>(config_.frames);
+                         index = next_index++) {
+                      const auto begin = chrono::steady_clock::now();
+                      // Deadlines count from the start of the decoding
+                      DecodedFrame frame{index, cv::Mat(), begin};
+                      bool decoded =
+                          decode_(index, frame.image, frame.transform);
+                      decode_stats_.add(chrono::steady_clock::now() - begin);
+                      if (!decoded) {
+                        spdlog::warn("Failed to decode frame {}.", index);
+                        continue;
+                      }
+                      decoded_.push(move(frame));
+                    }
+                  });
+    start_workers(config_.preprocess_workers, &preprocessed_,
+                  affinity.preprocess, threads, [this] {
+                    DecodedFrame frame;
+                    while (decoded_.pop(frame)) {
+                      const auto begin = chrono::steady_clock::now();
+                      tensors_struct *tensors = preprocess_(frame.image);
+                      preprocess_stats_.add(chrono::steady_clock::now() -
+                                            begin);
+                      frame.image.release();
+                      if (!tensors) {
+                        spdlog::warn("Failed to preprocess frame {}.",
+                                     frame.index);
+                        continue;
+                      }
+                      preprocessed_.push(TimedFrame{
+                          tensors, frame.captured_at, frame.transform});
+                    }
+                  });
+    start_workers(config_.postprocess_workers, &postprocessed_,
+                  affinity.postprocess, threads, [this] {
+                    FrameResult result;
+                    while (received_.pop(result)) {
+                      const auto begin = chrono::steady_clock::now();
+                      postprocess_(result);
+                      postprocess_stats_.add(chrono::steady_clock::now() -
+                                             begin);
+                      postprocessed_.push(move(result));
+                    }
+                  });
+    size_t sunk = 0;
+    thread sink_thread([this, &sunk, &affinity] {
+      pin_current_thread(affinity.sink);
+      FrameResult result;
+      while (postprocessed_.pop(result)) {
+        const auto begin = chrono::steady_clock::now();
+        sink_(result);
+        sink_stats_.add(chrono::steady_clock::now() - begin);
+        sunk++;
+      }
+    });
+
+    // The receive thread hands the outputs over to the postprocessing
+    inference_->set_output_handler(
+        [this](uint64_t request_id, size_t frame, const FrameOutput &output) {
+          FrameResult result;
+          result.request_id = request_id;
+          result.frame = frame;
+          result.output = output;
+          received_.push(move(result));
+        });
+    bool success = inference_->run(
+        [this](TimedFrame &frame) { return preprocessed_.pop(frame); });
+    received_.close();
+
+    for (thread &worker : threads) {
+      worker.join();
+    }
+    sink_thread.join();
+    // Frames left over after a failure of the inference
+    TimedFrame frame;
+    while (preprocessed_.try_pop(frame)) {
+      deep_free_tensors_struct(frame.tensors);
+    }
+    report(chrono::steady_clock::now() - start);
+    // Frames that missed their deadline do not count as failures
+    return success &&
+           sunk + inference_->dropped_frames() ==
+               static_cast<size_t>(config_.frames);
+  }
+
+ private:
+  struct DecodedFrame {
+    size_t index;
+    cv::Mat image;
+    chrono::steady_clock::time_point captured_at;
+    ImageTransform transform = ImageTransform();
+  };
+
+  // Start `count` threads running `work`, the i-th pinned to `cpus[i]` if
+  // any, and close `output` once the last of them is done
+  template <typename T>
+  void start_workers(int count, BoundedQueue<T> *output,
+                     const vector<CpuSet> &cpus, vector<thread> &threads,
+                     function<void()> work) {
+    shared_ptr<atomic<int>> running = make_shared<atomic<int>>(count);
+    for (int i = 0; i < count; ++i) {
+      CpuSet worker_cpus;
+      if (static_cast<size_t>(i) < cpus.size()) {
+        worker_cpus = cpus[i];
+      }
+      threads.emplace_back([output, running, work, worker_cpus] {
+        pin_current_thread(worker_cpus);
+        work();
+        if (--*running == 0) {
+          output->close();
+        }
+      });
+    }
+  }
+
+  // Log how busy every stage was and how full its input queue ran, to spot
+  // the bottleneck: the stage closest to 100% busy, right after a queue that
+  // runs full. A full queue before the send stage means the runtimes are.
+  void report(chrono::steady_clock::duration elapsed) {
+    spdlog::info("Pipeline: {} frame(s) in {} ms", config_.frames,
+                 chrono::duration_cast<chrono::milliseconds>(elapsed).count());
+    log_stage(decode_stats_, elapsed);
+    log_queue("preprocess", decoded_.mean_fill());
+    log_stage(preprocess_stats_, elapsed);
+    log_queue("send", preprocessed_.mean_fill());
+    log_queue("postprocess", received_.mean_fill());
+    log_stage(postprocess_stats_, elapsed);
+    log_queue("sink", postprocessed_.mean_fill());
+    log_stage(sink_stats_, elapsed);
+  }
+
+  static void log_stage(const StageStats &stats,
+                        chrono::steady_clock::duration elapsed) {
+    spdlog::info("  {:<12} {} worker(s), {:5.1f}% busy, {} frame(s)",
+                 stats.name(), stats.workers(),
+                 100.0 * stats.occupancy(elapsed), stats.items());
+  }
+
+  static void log_queue(const char *stage, double fill) {
+    spdlog::info("  {:<12} input queue {:5.1f}% full", stage, 100.0 * fill);
+  }
+
+  InferencePipeline *inference_;
+  const StageConfig config_;
+  DecodeFunction decode_;
+  PreprocessFunction preprocess_;
+  PostprocessFunction postprocess_;
+  SinkFunction sink_;
+  BoundedQueue<DecodedFrame> decoded_;
+  BoundedQueue<TimedFrame> preprocessed_;
+  BoundedQueue<FrameResult> received_;
+  BoundedQueue<FrameResult> postprocessed_;
+  StageStats decode_stats_;
+  StageStats preprocess_stats_;
+  StageStats postprocess_stats_;
+  StageStats sink_stats_;
+};
@@ -1,13 +1,129 @@
-tensors_struct *create_tensors(cv::Mat &image, string &input_name,
-                               bool nchw = true,
-                               const string &input_dtype = "float32") {
+// Quantization parameters of integer input tensors:
+// q = round((x - mean) / std / scale) + zero_point
+struct InputQuantization {
+  float scale;
+  int zero_point;
+  InputQuantization(float input_scale = 1.0f, int input_zero_point = 0)
+      : scale(input_scale), zero_point(input_zero_point) {}
+};
+
+// Fused normalization and layout kernel for float tensors.
+// Reads every BGR pixel of the resized 8-bit image exactly once, swaps it to
+// RGB, applies (x - mean) / std and writes the result straight into the tensor
+// buffer, either planar (NCHW) or interleaved (NHWC).
+void normalize_into_tensor(const cv::Mat &image, const float mean[3],
+                           const float stddev[3], bool nchw,
+                           float *tensor_data) {
+  const int rows = image.rows;
+  const int cols = image.cols;
+  const size_t plane_size = static_cast<size_t>(rows) * cols;
+  // (x - mean) / std == x * scale + bias
+  float scale[3], bias[3];
+  for (int c = 0; c < 3; ++c) {
+    scale[c] = 1.0f / stddev[c];
+    bias[c] = -mean[c] * scale[c];
+  }
+  // The deinterleave kernels map source channel k to plane k, so the BGR
+  // pixels are written to the RGB planes in reverse order
+  const float scale_bgr[3] = {scale[2], scale[1], scale[0]};
+  const float bias_bgr[3] = {bias[2], bias[1], bias[0]};
+  for (int h = 0; h < rows; ++h) {
+    const uint8_t *src = image.ptr<uint8_t>(h);
+    if (nchw) {
+      float *r = tensor_data + static_cast<size_t>(h) * cols;
+      deinterleave_kernels().u8_to_f32(src, cols, scale_bgr, bias_bgr,
+                                       r + 2 * plane_size, r + plane_size, r);
+    } else {
+      float *dst = tensor_data + static_cast<size_t>(h) * cols * 3;
+      for (int w = 0; w < cols; ++w, src += 3, dst += 3) {
+        dst[0] = src[2] * scale[0] + bias[0];
+        dst[1] = src[1] * scale[1] + bias[1];
+        dst[2] = src[0] * scale[2] + bias[2];
+      }
+    }
+  }
+}
+
+// Identity planar row writers for integer tensors
+inline void deinterleave_row(const uint8_t *src, int cols, uint8_t *r,
+                             uint8_t *g, uint8_t *b) {
+  deinterleave_kernels().u8_to_u8(src, cols, b, g, r);
+}
+
+inline void deinterleave_row(const uint8_t *src, int cols, int8_t *r,
+                             int8_t *g, int8_t *b) {
+  deinterleave_kernels().u8_to_i8(src, cols, b, g, r);
+}
+
+// Fused quantization and layout kernel for uint8/int8 tensors.
+// The pixels never go through float: mean, std, scale and zero point are
+// folded into one 256-entry lookup table per channel. When they are the
+// identity the table is skipped and the pixels are only deinterleaved.
+template <typename T>
+void quantize_into_tensor(const cv::Mat &image, const float mean[3],
+                          const float stddev[3],
+                          const InputQuantization &quantization, bool nchw,
+                          T *tensor_data) {
+  const int rows = image.rows;
+  const int cols = image.cols;
+  const size_t plane_size = static_cast<size_t>(rows) * cols;
+  bool identity = quantization.scale == 1.0f && quantization.zero_point == 0;
+  for (int c = 0; c < 3; ++c) {
+    identity = identity && mean[c] == 0.0f && stddev[c] == 1.0f;
+  }
+  // Lookup tables indexed by the RGB channel, then by the pixel value
+  T lut[3][256];
+  for (int c = 0; c < 3; ++c) {
+    const float scale = 1.0f / (stddev[c] * quantization.scale);
+    for (int x = 0; x < 256; ++x) {
+      lut[c][x] = cv::saturate_cast<T>((x - mean[c]) * scale +
+                                       quantization.zero_point);
+    }
+  }
+  for (int h = 0; h < rows; ++h) {
+    const uint8_t *src = image.ptr<uint8_t>(h);
+    if (nchw) {
+      T *r = tensor_data + static_cast<size_t>(h) * cols;
+      T *g = r + plane_size;
+      T *b = g + plane_size;
+      if (identity) {
+        deinterleave_row(src, cols, r, g, b);
+        continue;
+      }
+      for (int w = 0; w < cols; ++w, src += 3) {
+        r[w] = lut[0][src[2]];
+        g[w] = lut[1][src[1]];
+        b[w] = lut[2][src[0]];
+      }
+    } else {
+      T *dst = tensor_data + static_cast<size_t>(h) * cols * 3;
+      for (int w = 0; w < cols; ++w, src += 3, dst += 3) {
+        dst[0] = lut[0][src[2]];
+        dst[1] = lut[1][src[1]];
+        dst[2] = lut[2][src[0]];
+      }
+    }
+  }
+}
+
+tensors_struct *create_tensors(const cv::Mat &image, const string &input_name,
+                               const cv::Scalar &mean,
+                               const cv::Scalar &stddev, bool nchw = true,
+                               const string &input_dtype = "float32",
+                               const InputQuantization &quantization =
+                                   InputQuantization()) {
   spdlog::info("Creating tensors for input image: {}", input_name);
   if (image.empty()) {
     spdlog::error("Input image is empty.");
     exit(EXIT_FAILURE);
   }
-  // Cast image to float
-  image.convertTo(image, CV_32F);
+  if (image.type() != CV_8UC3) {
+    spdlog::error("Input image must be an 8-bit, 3-channel BGR image.");
+    exit(EXIT_FAILURE);
+  }
+  spdlog::info("Mean: {}, {}, {}", mean[0], mean[1], mean[2]);
+  spdlog::info("Stddev: {}, {}, {}", stddev[0], stddev[1], stddev[2]);
+  spdlog::debug("Deinterleave kernels: {}", deinterleave_kernels().name);
 
   // Create a new tensors_struct for the input tensor
   tensors_struct *tensors =
@@ -33,96 +149,43 @@ tensors_struct *create_tensors(cv::Mat &image, string &input_name,
     spdlog::error("Unsupported input data type.");
     exit(EXIT_FAILURE);
   }
-  // Set the rank of the tensor (assuming 4D for NCHW format)
-  tensors->ranks[0] = 4;  // NCHW format
+  // Set the rank of the tensor
+  tensors->ranks[0] = 4;
   // Allocate memory for the shape of the tensor
   tensors->shapes[0] = (size_t *)malloc(4 * sizeof(size_t));
   // Set the shape of the tensor
   if (nchw) {
-    // For UINT8 and INT8, we assume the image is in HWC format
-    // Convert to NCHW format
     tensors->shapes[0][0] = 1;                 // Batch size N
-    tensors->shapes[0][1] = image.channels();  // Number of channels
+    tensors->shapes[0][1] = image.channels();  // Number of channels C
     tensors->shapes[0][2] = image.rows;        // Height H
     tensors->shapes[0][3] = image.cols;        // Width W
   } else {
-    // For FLOAT32, we assume the image is already in NCHW format
     tensors->shapes[0][0] = 1;                 // Batch size N
     tensors->shapes[0][1] = image.rows;        // Height H
     tensors->shapes[0][2] = image.cols;        // Width W
     tensors->shapes[0][3] = image.channels();  // Number of channels C
   }
-  // Allocate memory for the tensor data
+
+  const float mean_values[3] = {static_cast<float>(mean[0]),
+                                static_cast<float>(mean[1]),
+                                static_cast<float>(mean[2])};
+  const float stddev_values[3] = {static_cast<float>(stddev[0]),
+                                  static_cast<float>(stddev[1]),
+                                  static_cast<float>(stddev[2])};
+  // Allocate the tensor data and fill it in a single pass over the image
   size_t tensor_size = image.total() * image.channels();
   if (input_dtype == "uint8") {
-    tensors->data[0] = (uint8_t *)malloc(tensor_size * sizeof(uint8_t));
-    // Copy the image data to the tensor data
-    uint8_t *tensor_data = (uint8_t *)tensors->data[0];
-    for (int h = 0; h < image.rows; ++h) {
-      for (int w = 0; w < image.cols; ++w) {
-        for (int c = 0; c < image.channels(); ++c) {
-          tensor_data[c * image.rows * image.cols + h * image.cols + w] =
-              static_cast<uint8_t>(image.at<cv::Vec3f>(h, w)[c]);
-        }
-      }
-    }
-    if (nchw) {
-      // Convert to NCHW format
-      for (int h = 0; h < image.rows; ++h) {
-        for (int w = 0; w < image.cols; ++w) {
-          for (int c = 0; c < image.channels(); ++c) {
-            tensor_data[c * image.rows * image.cols + h * image.cols + w] =
-                tensor_data[c * image.rows * image.cols + h * image.cols + w];
-          }
-        }
-      }
-    }
+    tensors->data[0] = malloc(tensor_size * sizeof(uint8_t));
+    quantize_into_tensor(image, mean_values, stddev_values, quantization,
+                         nchw, (uint8_t *)tensors->data[0]);
   } else if (input_dtype == "int8") {
-    tensors->data[0] = (int8_t *)malloc(tensor_size * sizeof(int8_t));
-    // Copy the image data to the tensor data
-    int8_t *tensor_data = (int8_t *)tensors->data[0];
-    for (int h = 0; h < image.rows; ++h) {
-      for (int w = 0; w < image.cols; ++w) {
-        for (int c = 0; c < image.channels(); ++c) {
-          tensor_data[c * image.rows * image.cols + h * image.cols + w] =
-              static_cast<int8_t>(image.at<cv::Vec3f>(h, w)[c]);
-        }
-      }
-    }
-    if (nchw) {
-      // Convert to NCHW format
-      for (int h = 0; h < image.rows; ++h) {
-        for (int w = 0; w < image.cols; ++w) {
-          for (int c = 0; c < image.channels(); ++c) {
-            tensor_data[c * image.rows * image.cols + h * image.cols + w] =
-                tensor_data[c * image.rows * image.cols + h * image.cols + w];
-          }
-        }
-      }
-    }
+    tensors->data[0] = malloc(tensor_size * sizeof(int8_t));
+    quantize_into_tensor(image, mean_values, stddev_values, quantization,
+                         nchw, (int8_t *)tensors->data[0]);
   } else if (input_dtype == "float32") {
-    tensors->data[0] = (float *)malloc(tensor_size * sizeof(float));
-    // Copy the image data to the tensor data
-    float *tensor_data = (float *)tensors->data[0];
-    for (int h = 0; h < image.rows; ++h) {
-      for (int w = 0; w < image.cols; ++w) {
-        for (int c = 0; c < image.channels(); ++c) {
-          tensor_data[c * image.rows * image.cols + h * image.cols + w] =
-              image.at<cv::Vec3f>(h, w)[c];
-        }
-      }
-    }
-    if (nchw) {
-      // Convert to NCHW format
-      for (int h = 0; h < image.rows; ++h) {
-        for (int w = 0; w < image.cols; ++w) {
-          for (int c = 0; c < image.channels(); ++c) {
-            tensor_data[c * image.rows * image.cols + h * image.cols + w] =
-                tensor_data[c * image.rows * image.cols + h * image.cols + w];
-          }
-        }
-      }
-    }
+    tensors->data[0] = malloc(tensor_size * sizeof(float));
+    normalize_into_tensor(image, mean_values, stddev_values, nchw,
+                          (float *)tensors->data[0]);
   }
   return tensors;  // Return the created tensor
 }
@@ -0,0 +1,117 @@
+#include <cstring>
+
+// Size in bytes of one element of the given data type, 0 if unknown
+size_t tensor_element_size(tensor_data_type data_type) {
+  switch (data_type) {
+    case DATA_TYPE_FLOAT:
+      return sizeof(float);
+    case DATA_TYPE_UINT8:
+      return sizeof(uint8_t);
+    case DATA_TYPE_INT8:
+      return sizeof(int8_t);
+    default:
+      return 0;
+  }
+}
+
+// Size in bytes of the data of the i-th tensor, 0 if unknown
+size_t tensor_size_in_bytes(const tensors_struct *tensors, size_t i) {
+  size_t size = tensor_element_size(tensors->data_types[i]);
+  for (size_t d = 0; d < tensors->ranks[i]; ++d) {
+    size *= tensors->shapes[i][d];
+  }
+  return size;
+}
+
+// Memory of `size` bytes from `allocate`, zeroed
+void *allocate_zeroed(void *(*allocate)(size_t), size_t size) {
+  void *pointer = allocate(size > 0 ? size : 1);
+  if (pointer) {
+    memset(pointer, 0, size);
+  }
+  return pointer;
+}
+
+// Free tensors allocated with the allocator of `deallocate`, e.g. the outputs
+// of a runtime instance, see Runtime::deallocate. Partial copies are freed
+// too.
+void free_tensors(tensors_struct *tensors, void (*deallocate)(void *)) {
+  if (!tensors) {
+    return;
+  }
+  for (size_t i = 0; i < tensors->num_tensors; ++i) {
+    if (tensors->names) deallocate(tensors->names[i]);
+    if (tensors->shapes) deallocate(tensors->shapes[i]);
+    if (tensors->data) deallocate(tensors->data[i]);
+  }
+  deallocate(tensors->names);
+  deallocate(tensors->data_types);
+  deallocate(tensors->ranks);
+  deallocate(tensors->shapes);
+  deallocate(tensors->data);
+  deallocate(tensors);
+}
+
+// Empty tensors_struct of `num_tensors` tensors from `allocate`, whose arrays
+// are zeroed so that it can be freed by `free_tensors` while it is filled.
+// Returns nullptr on failure.
+tensors_struct *allocate_tensors(size_t num_tensors,
+                                 void *(*allocate)(size_t),
+                                 void (*deallocate)(void *)) {
+  tensors_struct *tensors =
+      (tensors_struct *)allocate_zeroed(allocate, sizeof(tensors_struct));
+  if (!tensors) {
+    return nullptr;
+  }
+  tensors->num_tensors = num_tensors;
+  tensors->names =
+      (char **)allocate_zeroed(allocate, num_tensors * sizeof(char *));
+  tensors->data_types = (tensor_data_type *)allocate_zeroed(
+      allocate, num_tensors * sizeof(tensor_data_type));
+  tensors->ranks =
+      (size_t *)allocate_zeroed(allocate, num_tensors * sizeof(size_t));
+  tensors->shapes =
+      (size_t **)allocate_zeroed(allocate, num_tensors * sizeof(size_t *));
+  tensors->data =
+      (void **)allocate_zeroed(allocate, num_tensors * sizeof(void *));
+  if (!tensors->names || !tensors->data_types || !tensors->ranks ||
+      !tensors->shapes || !tensors->data) {
+    tensors->num_tensors = 0;
+    free_tensors(tensors, deallocate);
+    return nullptr;
+  }
+  return tensors;
+}
+
+// Deep copy of tensors of known data types with the allocator of a runtime
+// instance, e.g. an input to send to it. Returns nullptr on failure.
+tensors_struct *copy_tensors(const tensors_struct *tensors,
+                             void *(*allocate)(size_t),
+                             void (*deallocate)(void *)) {
+  tensors_struct *copy =
+      allocate_tensors(tensors->num_tensors, allocate, deallocate);
+  if (!copy) {
+    spdlog::error("Failed to allocate a copy of the tensors.");
+    return nullptr;
+  }
+  for (size_t i = 0; i < tensors->num_tensors; ++i) {
+    const size_t name_size = strlen(tensors->names[i]) + 1;
+    const size_t shape_size = tensors->ranks[i] * sizeof(size_t);
+    const size_t data_size = tensor_size_in_bytes(tensors, i);
+    copy->names[i] = (char *)allocate_zeroed(allocate, name_size);
+    copy->shapes[i] = (size_t *)allocate_zeroed(allocate, shape_size);
+    copy->data[i] = allocate_zeroed(allocate, data_size);
+    if (data_size == 0 || !copy->names[i] || !copy->shapes[i] ||
+        !copy->data[i]) {
+      spdlog::error("Failed to copy tensor {}.", tensors->names[i]);
+      free_tensors(copy, deallocate);
+      return nullptr;
+    }
+    memcpy(copy->names[i], tensors->names[i], name_size);
+    copy->data_types[i] = tensors->data_types[i];
+    copy->ranks[i] = tensors->ranks[i];
+    memcpy(copy->shapes[i], tensors->shapes[i], shape_size);
+    memcpy(copy->data[i], tensors->data[i], data_size);
+  }
+  return copy;
+}
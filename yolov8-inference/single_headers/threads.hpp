@@ -1,93 +1,394 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <vector>
 
-static int number_of_received_outputs = 0;
-static int max_number_of_nonprocessed_inputs = 10;
-static int time_to_wait_for_output_before_sending_input = 100;  // milliseconds
-static int max_number_of_consecutive_waits =
-    1000;                        // Maximum consecutive waits before stopping
-static int num_iterations = 10;  // Number of iterations for the routine
-static bool input_thread_interrupted = false;
-
-void send_input_tensors_routine(Runtime *runtime,
-                                tensors_struct *original_tensors) {
-  input_thread_interrupted = false;
-  // This function would contain the logic to send input tensors to the
-  // runtime For demonstration, we will just print a message
-  if (!original_tensors) {
-    spdlog::error("No input tensors provided to send.");
-    return;
+// Limits of a pipeline
+struct PipelineOptions {
+  int num_iterations = 10;  // Number of frames to send
+  // Requests in flight per runtime instance
+  WindowConfig window;
+  chrono::milliseconds max_time_to_wait_for_output{100000};
+  chrono::milliseconds time_to_wait_for_output{2000};
+  // Time from the capture of a frame to its output after which the frame is
+  // dropped, 0 for none
+  chrono::microseconds deadline{0};
+  // Release outputs in input order when the runtimes complete them out of
+  // order. Always on with several runtime instances and one model duplicate.
+  bool reorder_outputs = false;
+  // Model duplicates of every runtime instance. With more than one, an
+  // instance may complete its requests out of order while its outputs are
+  // matched to them in send order: reordering is then off, and the latency,
+  // deadline and transform of every output are approximate.
+  int n_duplicates = 1;
+  BatchingConfig batching;
+  // Cores of the sending and receiving threads, unpinned by default
+  AffinityPlan affinity;
+};
+
+// Sends frames to a runtime group and receives their outputs, on two threads.
+// All of its state is its own, so several pipelines, e.g. for different models
+// or runtimes, can run concurrently in one process.
+class InferencePipeline {
+ public:
+  // Sets `frame` to the next frame to send, whose ownership it transfers.
+  // Returns false once there are no frames left. May block.
+  typedef function<bool(TimedFrame &frame)> FrameSource;
+  // Called with the output of every frame, in input order if reordering
+  typedef function<void(uint64_t request_id, size_t frame,
+                        const FrameOutput &output)>
+      OutputHandler;
+
+  InferencePipeline(RuntimeGroup *runtimes, const PipelineOptions &options)
+      : runtimes_(runtimes),
+        options_(options),
+        inflight_window_(options.window.initial *
+                         static_cast<int>(runtimes->size())),
+        window_controller_(options.window,
+                           static_cast<int>(runtimes->size())),
+        next_request_id_(0) {
+    reset();
+    // Several instances complete their requests out of order
+    options_.reorder_outputs = options.reorder_outputs || runtimes->size() > 1;
+    if (options.n_duplicates > 1) {
+      spdlog::warn(
+          "{} model duplicates per runtime instance may complete requests out "
+          "of order: outputs are not reordered, and their latencies and "
+          "frames are approximate.",
+          options.n_duplicates);
+      options_.reorder_outputs = false;
+    }
+    output_handler_ = [this](uint64_t request_id, size_t frame,
+                             const FrameOutput &output) {
+      spdlog::info("Output tensors received: {} (request {}, frame {})",
+                   number_of_received_outputs_.load(), request_id, frame);
+      spdlog::debug("First output tensor: {}", output.name(0));
+    };
+  }
+
+  void set_output_handler(OutputHandler handler) {
+    output_handler_ = move(handler);
+  }
+
+  // Send every frame of `next_frame` and wait for their outputs. The frames
+  // that are not sent are freed.
+  // Returns true if every frame was sent and its output received.
+  // The pipeline can run again once this returns.
+  bool run(const FrameSource &next_frame) {
+    reset();
+    thread input_thread(&InferencePipeline::send_input_tensors_routine, this,
+                        cref(next_frame));
+    thread output_thread(&InferencePipeline::receive_output_tensors_routine,
+                         this);
+    input_thread.join();
+    output_thread.join();
+    return !input_thread_interrupted_ && failed_frames_ == 0 &&
+           number_of_received_outputs_ >= sent_frames_;
   }
-  spdlog::info("Sending input tensors to the runtime...");
-  int number_of_consecutive_waits = 0;
-  int i = 0;
-  int exit_code = 0;
-  while (i < num_iterations) {
-    if (i - number_of_received_outputs >= max_number_of_nonprocessed_inputs) {
-      if (number_of_consecutive_waits >= max_number_of_consecutive_waits) {
+
+  void send_input_tensors_routine(const FrameSource &next_frame) {
+    pin_current_thread(options_.affinity.sender);
+    spdlog::info("Sending input tensors to the runtime...");
+    // Frames are produced independently of the sending, and grouped into
+    // batches of up to batching.max_batch frames
+    BatchQueue queue(options_.batching);
+    thread producer([this, &queue, &next_frame] {
+      pin_current_thread(options_.affinity.sender);
+      TimedFrame frame;
+      while (next_frame(frame)) {
+        queue.submit(frame);
+      }
+      queue.close();
+    });
+    vector<TimedFrame> queued;
+    vector<tensors_struct *> frames;
+    vector<ImageTransform> transforms;
+    while (queue.next_batch(queued)) {
+      // Wait until fewer requests than the window are in flight
+      if (!inflight_window_.acquire_for(
+              options_.max_time_to_wait_for_output)) {
         spdlog::error(
-            "Too many consecutive waits without output. "
+            "Timed out waiting for output. "
             "Stopping sending input tensors.");
-        input_thread_interrupted = true;
-        return;
+        input_thread_interrupted_ = true;
+        stop_receiving_ = true;
+        for (const TimedFrame &frame : queued) {
+          deep_free_tensors_struct(frame.tensors);
+        }
+        break;
+      }
+      // Frames may expire while waiting for room in the window
+      const chrono::steady_clock::time_point deadline =
+          take_live_frames(queued, frames, transforms);
+      if (frames.empty()) {
+        inflight_window_.release();
+        continue;
+      }
+      if (!send_batch(frames, transforms, deadline)) {
+        inflight_window_.release();
       }
-      this_thread::sleep_for(
-          chrono::milliseconds(time_to_wait_for_output_before_sending_input));
-      number_of_consecutive_waits++;
-      continue;  // Skip sending if the limit is reached
     }
-    // Deep copy the original tensors to avoid modifying them
-    tensors_struct *tensors = deep_copy_tensors_struct(original_tensors);
-    exit_code = runtime->send_input(tensors);
-    if (exit_code != 0) {
-      spdlog::warn("Failed to send input tensors: {}",
-                   runtime->runtime_error_message());
-      deep_free_tensors_struct(tensors);
+    if (input_thread_interrupted_) {
+      // Drop the frames that were never sent, until the producer is done
+      while (queue.next_batch(queued)) {
+        for (const TimedFrame &frame : queued) {
+          deep_free_tensors_struct(frame.tensors);
+        }
+      }
+      producer.join();
+      return;
+    }
+    producer.join();
+    // The receiver stops once it has the outputs of every frame sent
+    sending_done_ = true;
+    if (number_of_received_outputs_ >= sent_frames_) {
+      stop_receiving_ = true;
     }
-    spdlog::info("Sent input tensors: {}", i + 1);
-    number_of_consecutive_waits = 0;  // Reset the wait counter
-    i++;
+    spdlog::info("All input tensors sent: {} frame(s), {} failed.",
+                 sent_frames_.load(), failed_frames_.load());
   }
-  // Simulate sending tensors
-  spdlog::info("All input tensors sent successfully.");
-}
-
-void receive_output_tensors_routine(Runtime *runtime) {
-  // This function would contain the logic to receive output tensors from the
-  // runtime
-  int number_of_consecutive_failures_to_receive_output = 0;
-  int exit_code = 0;
-  int i = 0;
-  while (i < num_iterations) {
-    if (input_thread_interrupted) {
+
+  void receive_output_tensors_routine() {
+    pin_current_thread(options_.affinity.receiver);
+    // Poll the runtimes with an adaptive wait, instead of fixed retry sleeps
+    OutputPoller poller(runtimes_);
+    while (!sending_done_ || number_of_received_outputs_ < sent_frames_) {
+      size_t instance = 0;
+      tensors_struct *output_tensors = poller.receive(
+          options_.time_to_wait_for_output, instance, &stop_receiving_);
+      if (!output_tensors) {
+        // Only give up while waiting for the outputs of sent frames
+        if (!stop_receiving_ && number_of_received_outputs_ >= sent_frames_) {
+          continue;
+        }
+        break;
+      }
+      inflight_window_.release();  // Wake the sender
+      InferenceRequest request;
+      chrono::microseconds latency;
+      // Outputs are allocated in the heap of their instance
+      void (*deallocate)(void *) = runtimes_->instance(instance)->deallocate;
+      if (!request_trackers_[instance].complete(request, latency)) {
+        spdlog::warn("Received output tensors without a request.");
+        free_tensors(output_tensors, deallocate);
+        continue;
+      }
+      number_of_received_outputs_ += static_cast<int>(request.batch_size);
+      spdlog::debug("Request {} latency: {} us", request.id, latency.count());
+      if (options_.window.adaptive &&
+          window_controller_.on_complete(latency)) {
+        inflight_window_.resize(window_controller_.window());
+      }
+      if (chrono::steady_clock::now() > request.deadline) {
+        // Too late to be of any use
+        expired_on_receive_ += static_cast<int>(request.batch_size);
+        free_tensors(output_tensors, deallocate);
+        if (options_.reorder_outputs) {
+          output_reorder_buffer_.skip(request.id, request_outputs_callback());
+        }
+        continue;
+      }
+      // Print the received output tensors metadata
+      // print_tensors_metadata(output_tensors);
+
+      // The frames of a batch are views into the batched outputs, without
+      // copies
+      vector<FrameOutput> frames = split_batch(
+          output_tensors, request.batch_size, deallocate, request.transforms);
+      if (options_.reorder_outputs) {
+        output_reorder_buffer_.push(request.id, move(frames),
+                                    request_outputs_callback());
+      } else {
+        handle_request_outputs(request.id, frames);
+      }
+    }
+    LatencyStats stats = latency_stats();
+    spdlog::info(
+        "Latency over {} requests: mean {:.0f} us, p50 {} us, p99 {} us, "
+        "max {} us",
+        stats.count(), stats.mean_us(), stats.percentile_us(50),
+        stats.percentile_us(99), stats.max_us());
+    spdlog::info("In-flight window: {} request(s)", inflight_window());
+    spdlog::info(
+        "Dropped frames: {} expired before send, {} expired on receive, {} "
+        "failed to send",
+        expired_before_send_.load(), expired_on_receive_.load(),
+        failed_frames_.load());
+    if (input_thread_interrupted_) {
       spdlog::error("Input thread interrupted, stopping receiving outputs.");
       return;
     }
-    tensors_struct *output_tensors = nullptr;
-    exit_code = runtime->receive_output(&output_tensors);
-    if (exit_code != 0) {
-      if (number_of_consecutive_failures_to_receive_output >= 20) {
-        spdlog::error(
-            "Too many consecutive failures to receive output. "
-            "Stopping output receiving.");
-        return;
-      }
-      // Sleep for a short duration before retrying
-      this_thread::sleep_for(chrono::milliseconds(100));
-      number_of_consecutive_failures_to_receive_output++;
-      continue;  // Skip this iteration if receiving fails
+    if (number_of_received_outputs_ < sent_frames_) {
+      spdlog::error(
+          "Timed out waiting for output. Stopping output receiving.");
+      return;
     }
-    // Print the received output tensors metadata
-    // print_tensors_metadata(output_tensors);
+    spdlog::info("Output tensors received successfully.");
+  }
 
-    deep_free_tensors_struct(output_tensors);
+  int received_outputs() const { return number_of_received_outputs_; }
+  int sent_frames() const { return sent_frames_; }
+  int failed_frames() const { return failed_frames_; }
+  // Frames dropped for missing their deadline
+  int dropped_frames() const {
+    return expired_before_send_ + expired_on_receive_;
+  }
+  // Current limit of the requests in flight, for all instances together
+  int inflight_window() { return inflight_window_.size(); }
+  // Cores of the threads of the pipeline
+  const AffinityPlan &affinity() const { return options_.affinity; }
+
+  // Latencies of the completed requests of all runtime instances
+  LatencyStats latency_stats() {
+    LatencyStats stats;
+    for (RequestTracker &request_tracker : request_trackers_) {
+      stats.merge(request_tracker.stats());
+    }
+    return stats;
+  }
+
+ private:
+  // Start a run from scratch: no frame sent, no request in flight and no
+  // latency recorded. Request IDs keep increasing across runs, so that a late
+  // output of a previous run matches no request.
+  void reset() {
+    number_of_received_outputs_ = 0;
+    sent_frames_ = 0;
+    failed_frames_ = 0;
+    expired_before_send_ = 0;
+    expired_on_receive_ = 0;
+    input_thread_interrupted_ = false;
+    sending_done_ = false;
+    stop_receiving_ = false;
+    const int num_instances = static_cast<int>(runtimes_->size());
+    inflight_window_.reset(options_.window.initial * num_instances);
+    window_controller_.reset();
+    // Requests are tracked per runtime instance, with shared IDs
+    request_trackers_.clear();
+    for (int i = 0; i < num_instances; ++i) {
+      request_trackers_.emplace_back(&next_request_id_);
+    }
+    output_reorder_buffer_.reset(next_request_id_);
+  }
+
+  // Move the frames of `queued` whose deadline has not passed to `frames`,
+  // and their transforms to `transforms`, and drop the others. Returns the
+  // earliest deadline of the kept frames.
+  chrono::steady_clock::time_point take_live_frames(
+      const vector<TimedFrame> &queued, vector<tensors_struct *> &frames,
+      vector<ImageTransform> &transforms) {
+    frames.clear();
+    transforms.clear();
+    chrono::steady_clock::time_point earliest =
+        chrono::steady_clock::time_point::max();
+    const auto now = chrono::steady_clock::now();
+    for (const TimedFrame &frame : queued) {
+      if (options_.deadline.count() == 0) {
+        frames.push_back(frame.tensors);
+        transforms.push_back(frame.transform);
+        continue;
+      }
+      const auto deadline = frame.captured_at + options_.deadline;
+      if (deadline <= now) {
+        expired_before_send_++;
+        deep_free_tensors_struct(frame.tensors);
+        continue;
+      }
+      frames.push_back(frame.tensors);
+      transforms.push_back(frame.transform);
+      earliest = min(earliest, deadline);
+    }
+    return earliest;
+  }
+
+  // Consume the outputs of the frames of a request
+  void handle_request_outputs(uint64_t request_id,
+                              const vector<FrameOutput> &frames) {
+    for (size_t n = 0; n < frames.size(); ++n) {
+      output_handler_(request_id, n, frames[n]);
+    }
+  }
 
-    number_of_received_outputs++;
-    number_of_consecutive_failures_to_receive_output =
-        0;  // Reset the failure counter
-    spdlog::info("Output tensors received: {}", number_of_received_outputs);
-    i++;
+  ReorderBuffer<vector<FrameOutput>>::Callback request_outputs_callback() {
+    return [this](uint64_t request_id, vector<FrameOutput> frames) {
+      handle_request_outputs(request_id, frames);
+    };
   }
-  spdlog::info("Output tensors received successfully.");
-}
\ No newline at end of file
+
+  // Send the frames of one batch as a single request.
+  // Ownership of the frames is taken: a single frame is sent as is to an
+  // instance sharing the heap of the host. Otherwise the frames are packed, or
+  // copied, with the allocator of the instance and freed.
+  // Returns false if the batch could not be sent.
+  bool send_batch(const vector<tensors_struct *> &frames,
+                  const vector<ImageTransform> &transforms,
+                  chrono::steady_clock::time_point deadline) {
+    const int batch_size = static_cast<int>(frames.size());
+    const size_t instance = runtimes_->least_loaded();
+    Runtime *runtime = runtimes_->instance(instance);
+    tensors_struct *tensors = frames.front();
+    const bool copied = frames.size() > 1 || runtime->isolated;
+    if (copied) {
+      tensors = frames.size() > 1
+                    ? pack_batch(frames, runtime->allocate, runtime->deallocate)
+                    : copy_tensors(frames.front(), runtime->allocate,
+                                   runtime->deallocate);
+      for (tensors_struct *frame : frames) {
+        deep_free_tensors_struct(frame);
+      }
+      if (!tensors) {
+        failed_frames_ += batch_size;
+        return false;
+      }
+    }
+    RequestTracker &request_tracker = request_trackers_[instance];
+    InferenceRequest request =
+        request_tracker.begin(frames.size(), deadline, transforms);
+    // Counted before sending, so that the receiver always expects its output
+    sent_frames_ += batch_size;
+    if (runtimes_->send_input(instance, tensors) != 0) {
+      spdlog::warn("Failed to send input tensors: {}",
+                   runtime->runtime_error_message());
+      sent_frames_ -= batch_size;
+      failed_frames_ += batch_size;
+      // Ownership stays with us
+      if (copied) {
+        free_tensors(tensors, runtime->deallocate);
+      } else {
+        deep_free_tensors_struct(tensors);
+      }
+      // No output will come for this input
+      request_tracker.cancel(request);
+      if (options_.reorder_outputs) {
+        output_reorder_buffer_.skip(request.id, request_outputs_callback());
+      }
+      return false;
+    }
+    spdlog::info(
+        "Sent input tensors: request {} with {} frame(s) to runtime {}",
+        request.id, frames.size(), instance);
+    return true;
+  }
+
+  RuntimeGroup *runtimes_;
+  PipelineOptions options_;
+  OutputHandler output_handler_;
+  atomic<int> number_of_received_outputs_{0};
+  atomic<int> sent_frames_{0};
+  atomic<int> failed_frames_{0};
+  atomic<int> expired_before_send_{0};
+  atomic<int> expired_on_receive_{0};
+  atomic<bool> input_thread_interrupted_{false};
+  atomic<bool> sending_done_{false};
+  atomic<bool> stop_receiving_{false};
+  InflightWindow inflight_window_;
+  AimdController window_controller_;
+  atomic<uint64_t> next_request_id_;
+  deque<RequestTracker> request_trackers_;
+  ReorderBuffer<vector<FrameOutput>> output_reorder_buffer_;
+};
@@ -0,0 +1,188 @@
+// Thousands of requests through the AsyncRuntime of async_runtime.hpp, on
+// two isolated instances of the mock runtime, with futures and with
+// coroutines. Requests beyond max_in_flight have to wait in its queue.
+// Every input holds the number of its request, which the mock runtime echoes
+// back, so that an output completing the wrong request is caught.
+//
+// Usage: async_runtime_test <mock_runtime_library> [requests]
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lib_loader.h"
+#include "tensors_struct.h"
+
+using namespace std;
+
+#include "runtime.hpp"
+#include "runtime_group.hpp"
+#include "runtime_poller.hpp"
+#include "tensors_memory.hpp"
+#include "async_runtime.hpp"
+
+constexpr int kCompletionDelayUs = 200;
+constexpr int kMaxInFlight = 64;
+
+// Single float input holding `value`
+tensors_struct *make_input_tensors(float value) {
+  tensors_struct *tensors = (tensors_struct *)malloc(sizeof(tensors_struct));
+  tensors->num_tensors = 1;
+  tensors->names = (char **)malloc(sizeof(char *));
+  tensors->names[0] = strdup("input");
+  tensors->data_types = (tensor_data_type *)malloc(sizeof(tensor_data_type));
+  tensors->data_types[0] = DATA_TYPE_FLOAT;
+  tensors->ranks = (size_t *)malloc(sizeof(size_t));
+  tensors->ranks[0] = 1;
+  tensors->shapes = (size_t **)malloc(sizeof(size_t *));
+  tensors->shapes[0] = (size_t *)malloc(sizeof(size_t));
+  tensors->shapes[0][0] = 1;
+  tensors->data = (void **)malloc(sizeof(void *));
+  tensors->data[0] = malloc(sizeof(float));
+  *static_cast<float *>(tensors->data[0]) = value;
+  return tensors;
+}
+
+// Whether `outputs` are the echo of the input of request `i`
+bool is_output_of(const AsyncRuntime::Outputs &outputs, int i) {
+  return outputs && outputs->num_tensors == 1 &&
+         *static_cast<const float *>(outputs->data[0]) ==
+             static_cast<float>(i);
+}
+
+// Coroutine that starts right away and frees itself once it returns
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    suspend_never initial_suspend() noexcept { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+};
+
+DetachedTask infer_in_coroutine(AsyncRuntime &runtime, int i,
+                                atomic<int> &completed,
+                                atomic<int> &mismatched) {
+  try {
+    AsyncRuntime::Outputs outputs =
+        co_await runtime.infer_async(make_input_tensors(i));
+    if (!is_output_of(outputs, i)) {
+      mismatched++;
+    }
+  } catch (const exception &error) {
+    spdlog::error("Request {} failed: {}", i, error.what());
+    mismatched++;
+  }
+  completed++;
+}
+
+// Submit every request at once, then check that at most kMaxInFlight of them
+// were sent and the others queued
+bool check_window(AsyncRuntime &runtime, int count) {
+  const int in_flight = runtime.in_flight();
+  const size_t waiting = runtime.waiting();
+  printf("  %d in flight, %zu waiting\n", in_flight, waiting);
+  if (in_flight > kMaxInFlight) {
+    spdlog::error("{} requests in flight, over the limit of {}.", in_flight,
+                  kMaxInFlight);
+    return false;
+  }
+  if (count > 2 * kMaxInFlight && waiting == 0) {
+    spdlog::error("No request waits for room in the window.");
+    return false;
+  }
+  return true;
+}
+
+bool run_futures(AsyncRuntime &runtime, int count) {
+  printf("%d futures\n", count);
+  vector<future<AsyncRuntime::Outputs>> results;
+  for (int i = 0; i < count; ++i) {
+    results.push_back(runtime.infer(make_input_tensors(i)));
+  }
+  bool succeeded = check_window(runtime, count);
+  int mismatched = 0;
+  for (int i = 0; i < count; ++i) {
+    try {
+      if (!is_output_of(results[i].get(), i)) {
+        mismatched++;
+      }
+    } catch (const exception &error) {
+      spdlog::error("Request {} failed: {}", i, error.what());
+      mismatched++;
+    }
+  }
+  if (mismatched > 0) {
+    spdlog::error("{} of {} futures got the wrong outputs.", mismatched,
+                  count);
+    succeeded = false;
+  }
+  return succeeded;
+}
+
+bool run_coroutines(AsyncRuntime &runtime, int count) {
+  printf("%d coroutines\n", count);
+  atomic<int> completed(0);
+  atomic<int> mismatched(0);
+  for (int i = 0; i < count; ++i) {
+    infer_in_coroutine(runtime, i, completed, mismatched);
+  }
+  bool succeeded = check_window(runtime, count);
+  const auto give_up_at = chrono::steady_clock::now() + chrono::seconds(30);
+  while (completed < count && chrono::steady_clock::now() < give_up_at) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  if (completed < count) {
+    spdlog::error("Only {} of {} coroutines completed.", completed.load(),
+                  count);
+    return false;
+  }
+  if (mismatched > 0) {
+    spdlog::error("{} of {} coroutines got the wrong outputs.",
+                  mismatched.load(), count);
+    succeeded = false;
+  }
+  return succeeded;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <mock_runtime_library> [requests]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const int count = argc > 2 ? atoi(argv[2]) : 4000;
+  if (count < 1) {
+    fprintf(stderr, "The number of requests must be positive.\n");
+    return EXIT_FAILURE;
+  }
+  RuntimeGroup runtimes(argv[1], 2);
+  const char *keys[] = {"completion_delay_us"};
+  const void *values[] = {&kCompletionDelayUs};
+  for (size_t i = 0; i < runtimes.size(); ++i) {
+    if (runtimes.instance(i)->runtime_initialization_with_args(1, keys,
+                                                               values) != 0) {
+      spdlog::error("Failed to initialize the mock runtime.");
+      return EXIT_FAILURE;
+    }
+  }
+  bool succeeded;
+  {
+    // Destroyed before the runtimes, which free the outputs
+    AsyncRuntime runtime(&runtimes, kMaxInFlight);
+    succeeded = run_futures(runtime, count);
+    succeeded = run_coroutines(runtime, count) && succeeded;
+  }
+  return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
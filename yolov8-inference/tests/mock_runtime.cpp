@@ -0,0 +1,95 @@
+// Mock OAAX runtime for the tests, built as a shared library and loaded like
+// any runtime. Every input sent comes back unchanged as the output of its
+// request once the completion delay has passed, in send order.
+//
+// Arguments of runtime_initialization_with_args:
+//   "completion_delay_us": const int *, time from a send to its output
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include "tensors_struct.h"
+
+using namespace std;
+
+namespace {
+
+struct Request {
+  tensors_struct *tensors;
+  chrono::steady_clock::time_point ready_at;
+};
+
+mutex requests_mutex;
+deque<Request> requests;
+chrono::microseconds completion_delay(1000);
+
+void free_tensors(tensors_struct *tensors) {
+  for (size_t i = 0; i < tensors->num_tensors; ++i) {
+    free(tensors->names[i]);
+    free(tensors->shapes[i]);
+    free(tensors->data[i]);
+  }
+  free(tensors->names);
+  free(tensors->data_types);
+  free(tensors->ranks);
+  free(tensors->shapes);
+  free(tensors->data);
+  free(tensors);
+}
+
+}  // namespace
+
+extern "C" {
+
+int runtime_initialization() { return 0; }
+
+int runtime_initialization_with_args(int length, const char **keys,
+                                     const void **values) {
+  for (int i = 0; i < length; ++i) {
+    if (strcmp(keys[i], "completion_delay_us") == 0) {
+      completion_delay =
+          chrono::microseconds(*static_cast<const int *>(values[i]));
+    }
+  }
+  return 0;
+}
+
+int runtime_model_loading(const char *) { return 0; }
+
+int send_input(tensors_struct *input_tensors) {
+  if (!input_tensors) {
+    return 1;
+  }
+  lock_guard<mutex> lock(requests_mutex);
+  requests.push_back(
+      Request{input_tensors, chrono::steady_clock::now() + completion_delay});
+  return 0;
+}
+
+int receive_output(tensors_struct **output_tensors) {
+  lock_guard<mutex> lock(requests_mutex);
+  if (requests.empty() ||
+      requests.front().ready_at > chrono::steady_clock::now()) {
+    return 1;
+  }
+  *output_tensors = requests.front().tensors;
+  requests.pop_front();
+  return 0;
+}
+
+int runtime_destruction() {
+  lock_guard<mutex> lock(requests_mutex);
+  for (Request &request : requests) {
+    free_tensors(request.tensors);
+  }
+  requests.clear();
+  return 0;
+}
+
+const char *runtime_error_message() { return ""; }
+const char *runtime_version() { return "1.0.0"; }
+const char *runtime_name() { return "mock"; }
+
+}  // extern "C"
@@ -0,0 +1,158 @@
+// Receive delay of the outputs of the mock runtime: the time from an output
+// being ready to the receiving thread getting it. It is measured with the
+// retry sleep of 100 ms the receiving thread used to wait with, and with the
+// OutputPoller of runtime_poller.hpp.
+// Fails unless the poller at least halves the p99 delay and keeps it under
+// kMaxPollerP99Us.
+//
+// Usage: poll_latency_test <mock_runtime_library> [requests]
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lib_loader.h"
+#include "tensors_struct.h"
+
+using namespace std;
+
+#include "runtime.hpp"
+#include "runtime_group.hpp"
+#include "runtime_poller.hpp"
+
+// Time from a send to its output in the mock runtime
+constexpr int kCompletionDelayUs = 2000;
+// Largest p99 receive delay of the poller. It wakes up within 1 ms, the
+// rest is margin for loaded CI runners.
+constexpr int64_t kMaxPollerP99Us = 5000;
+
+// Smallest input: a single float
+tensors_struct *make_input_tensors() {
+  tensors_struct *tensors = (tensors_struct *)malloc(sizeof(tensors_struct));
+  tensors->num_tensors = 1;
+  tensors->names = (char **)malloc(sizeof(char *));
+  tensors->names[0] = strdup("input");
+  tensors->data_types = (tensor_data_type *)malloc(sizeof(tensor_data_type));
+  tensors->data_types[0] = DATA_TYPE_FLOAT;
+  tensors->ranks = (size_t *)malloc(sizeof(size_t));
+  tensors->ranks[0] = 1;
+  tensors->shapes = (size_t **)malloc(sizeof(size_t *));
+  tensors->shapes[0] = (size_t *)malloc(sizeof(size_t));
+  tensors->shapes[0][0] = 1;
+  tensors->data = (void **)malloc(sizeof(void *));
+  tensors->data[0] = calloc(1, sizeof(float));
+  return tensors;
+}
+
+// Send `count` requests 1 to 20 ms apart, like frames of a camera, while
+// `receive` waits for their outputs on this thread. Returns the receive
+// delays in microseconds, sorted.
+template <typename Receive>
+vector<int64_t> measure_receive_delays(RuntimeGroup &runtimes, int count,
+                                       Receive receive) {
+  vector<chrono::steady_clock::time_point> sent_at(count);
+  thread sender([&runtimes, &sent_at, count] {
+    mt19937 random(42);
+    uniform_int_distribution<int> gap_us(1000, 20000);
+    for (int i = 0; i < count; ++i) {
+      this_thread::sleep_for(chrono::microseconds(gap_us(random)));
+      sent_at[i] = chrono::steady_clock::now();
+      if (runtimes.send_input(0, make_input_tensors()) != 0) {
+        spdlog::error("Failed to send request {}.", i);
+        exit(EXIT_FAILURE);
+      }
+    }
+  });
+  vector<int64_t> delays;
+  for (int i = 0; i < count; ++i) {
+    tensors_struct *output_tensors = receive();
+    if (!output_tensors) {
+      spdlog::error("No output for request {}.", i);
+      exit(EXIT_FAILURE);
+    }
+    // Outputs come back in send order
+    const auto ready_at =
+        sent_at[i] + chrono::microseconds(kCompletionDelayUs);
+    delays.push_back(chrono::duration_cast<chrono::microseconds>(
+                         chrono::steady_clock::now() - ready_at)
+                         .count());
+    deep_free_tensors_struct(output_tensors);
+  }
+  sender.join();
+  sort(delays.begin(), delays.end());
+  return delays;
+}
+
+int64_t percentile(const vector<int64_t> &sorted, int percent) {
+  return sorted[(sorted.size() - 1) * percent / 100];
+}
+
+void report(const char *name, const vector<int64_t> &delays) {
+  printf("%-12s p50 %7lld us   p99 %7lld us   max %7lld us\n", name,
+         (long long)percentile(delays, 50), (long long)percentile(delays, 99),
+         (long long)delays.back());
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <mock_runtime_library> [requests]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const int count = argc > 2 ? atoi(argv[2]) : 200;
+  if (count < 1) {
+    fprintf(stderr, "The number of requests must be positive.\n");
+    return EXIT_FAILURE;
+  }
+  RuntimeGroup runtimes(argv[1], 1);
+  const char *keys[] = {"completion_delay_us"};
+  const void *values[] = {&kCompletionDelayUs};
+  if (runtimes.instance(0)->runtime_initialization_with_args(1, keys,
+                                                             values) != 0) {
+    spdlog::error("Failed to initialize the mock runtime.");
+    return EXIT_FAILURE;
+  }
+  printf("%d requests, outputs ready %d us after their send\n", count,
+         kCompletionDelayUs);
+
+  const vector<int64_t> sleep_delays =
+      measure_receive_delays(runtimes, count, [&runtimes] {
+        tensors_struct *output_tensors = nullptr;
+        size_t instance = 0;
+        while (runtimes.receive_output(&output_tensors, instance) != 0) {
+          this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        return output_tensors;
+      });
+  report("sleep 100 ms", sleep_delays);
+
+  OutputPoller poller(&runtimes);
+  const vector<int64_t> poller_delays =
+      measure_receive_delays(runtimes, count, [&poller] {
+        size_t instance = 0;
+        return poller.receive(chrono::milliseconds(1000), instance);
+      });
+  report("poller", poller_delays);
+
+  const int64_t poller_p99 = percentile(poller_delays, 99);
+  int code = EXIT_SUCCESS;
+  if (2 * poller_p99 > percentile(sleep_delays, 99)) {
+    spdlog::error("The poller does not cut the p99 receive delay.");
+    code = EXIT_FAILURE;
+  }
+  if (poller_p99 >= kMaxPollerP99Us) {
+    spdlog::error("The p99 receive delay of the poller exceeds {} us.",
+                  kMaxPollerP99Us);
+    code = EXIT_FAILURE;
+  }
+  return code;
+}